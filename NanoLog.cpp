@@ -24,7 +24,10 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 */
 
 #include "NanoLog.hpp"
+#include <cstddef>
 #include <cstring>
+#include <cstdio>
+#include <cmath>
 #include <chrono>
 #include <ctime>
 #include <thread>
@@ -32,6 +35,33 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SO
 #include <atomic>
 #include <queue>
 #include <fstream>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <csignal>
+#include <system_error>
+#include <stdexcept>
+#include <dirent.h>
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace
 {
@@ -58,12 +88,125 @@ namespace
 	os << '[' << buffer << microseconds << ']';
     }
 
-    std::thread::id this_thread_id()
+    /* I want 2016-10-13T00:01:23.528514Z for the structured formats */
+    void format_timestamp_iso8601(char (&buffer)[32], uint64_t timestamp)
     {
-	static thread_local const std::thread::id id = std::this_thread::get_id();
+	std::time_t time_t = timestamp / 1000000;
+	auto gmtime = std::gmtime(&time_t);
+	size_t const length = strftime(buffer, 32, "%Y-%m-%dT%T.", gmtime);
+	snprintf(buffer + length, 32 - length, "%06uZ", static_cast < unsigned int >(timestamp % 1000000));
+    }
+
+    /* Kernel thread id, as shown by top / ps -L / perf */
+    uint32_t this_thread_id()
+    {
+	static thread_local const uint32_t id = static_cast < uint32_t >(syscall(SYS_gettid));
 	return id;
     }
 
+    /*
+     * Names registered with nanolog::set_thread_name(). Updated rarely under a lock,
+     * readers keep their own copy and only refresh it when the generation moves.
+     * A thread which exits keeps its name for the lines it logged before, until the
+     * background thread has been idle for a second after the exit, see purge().
+     */
+    class ThreadNames
+    {
+    public:
+	void set(uint32_t thread_id, std::string const & name)
+	{
+	    std::lock_guard < std::mutex > guard(m_mutex);
+	    auto it = m_names.find(thread_id);
+	    if (it != m_names.end() && it->second.exited != std::numeric_limits < uint64_t >::max())
+		m_exited.fetch_sub(1, std::memory_order_relaxed);
+	    m_names[thread_id] = Name{ name, std::numeric_limits < uint64_t >::max() };
+	    m_generation.fetch_add(1, std::memory_order_release);
+	}
+
+	/* Lines of thread_id stamped after exit_timestamp are from a new thread reusing the id */
+	void exited(uint32_t thread_id, uint64_t exit_timestamp)
+	{
+	    std::lock_guard < std::mutex > guard(m_mutex);
+	    auto it = m_names.find(thread_id);
+	    if (it == m_names.end())
+		return;
+	    it->second.exited = exit_timestamp;
+	    m_exited.fetch_add(1, std::memory_order_relaxed);
+	    m_generation.fetch_add(1, std::memory_order_release);
+	}
+
+	/* Background thread only, when caught up. Forgets the names of threads which exited before cutoff. */
+	void purge(uint64_t cutoff)
+	{
+	    if (m_exited.load(std::memory_order_relaxed) == 0)
+		return;
+	    std::lock_guard < std::mutex > guard(m_mutex);
+	    for (auto it = m_names.begin(); it != m_names.end(); )
+	    {
+		if (it->second.exited < cutoff)
+		{
+		    it = m_names.erase(it);
+		    m_exited.fetch_sub(1, std::memory_order_relaxed);
+		    m_generation.fetch_add(1, std::memory_order_release);
+		}
+		else
+		{
+		    ++it;
+		}
+	    }
+	}
+
+	/* Name of thread_id for a line stamped timestamp, nullptr if it has none */
+	std::string const * lookup(uint32_t thread_id, uint64_t timestamp)
+	{
+	    static thread_local uint64_t cached_generation = 0;
+	    static thread_local std::unordered_map < uint32_t, Name > cache;
+	    uint64_t const generation = m_generation.load(std::memory_order_acquire);
+	    if (generation != cached_generation)
+	    {
+		std::lock_guard < std::mutex > guard(m_mutex);
+		cache = m_names;
+		cached_generation = generation;
+	    }
+	    auto it = cache.find(thread_id);
+	    return it == cache.end() || timestamp > it->second.exited ? nullptr : &it->second.name;
+	}
+
+	/* Writes the name of thread_id, or thread_id itself if it has none */
+	void print(std::ostream & os, uint32_t thread_id, uint64_t timestamp)
+	{
+	    if (std::string const * name = lookup(thread_id, timestamp))
+		os << *name;
+	    else
+		os << thread_id;
+	}
+
+    private:
+	struct Name
+	{
+	    std::string name;
+	    uint64_t exited;	// timestamp_now() when the thread exited, max while it runs
+	};
+
+	std::mutex m_mutex;
+	std::unordered_map < uint32_t, Name > m_names;
+	std::atomic < uint64_t > m_generation = { 0 };
+	std::atomic < uint32_t > m_exited = { 0 };
+    };
+
+    ThreadNames thread_names;
+
+    /* Retires the name when its thread exits, the kernel reuses thread ids */
+    struct ThreadNameOwner
+    {
+	~ThreadNameOwner()
+	{
+	    if (named)
+		thread_names.exited(this_thread_id(), timestamp_now());
+	}
+	bool named = false;
+    };
+
     template < typename T, typename Tuple >
     struct TupleIndex;
 
@@ -83,7 +226,188 @@ namespace
 
 namespace nanolog
 {
-    typedef std::tuple < char, uint32_t, uint64_t, int32_t, int64_t, double, NanoLogLine::string_literal_t, char * > SupportedTypes;
+    typedef std::tuple < char, uint32_t, uint64_t, int32_t, int64_t, double, NanoLogLine::string_literal_t, char *, NanoLogLine::field_key_t, NanoLogLine::interned_t, NanoLogLine::format_t > SupportedTypes;
+
+    static_assert(FormatArg < char >::signature == TupleIndex < char, SupportedTypes >::value + 1, "Format signature does not match type id");
+    static_assert(FormatArg < uint32_t >::signature == TupleIndex < uint32_t, SupportedTypes >::value + 1, "Format signature does not match type id");
+    static_assert(FormatArg < uint64_t >::signature == TupleIndex < uint64_t, SupportedTypes >::value + 1, "Format signature does not match type id");
+    static_assert(FormatArg < int32_t >::signature == TupleIndex < int32_t, SupportedTypes >::value + 1, "Format signature does not match type id");
+    static_assert(FormatArg < int64_t >::signature == TupleIndex < int64_t, SupportedTypes >::value + 1, "Format signature does not match type id");
+    static_assert(FormatArg < double >::signature == TupleIndex < double, SupportedTypes >::value + 1, "Format signature does not match type id");
+    static_assert(FormatArg < char[1] >::signature == TupleIndex < NanoLogLine::string_literal_t, SupportedTypes >::value + 1, "Format signature does not match type id");
+    static_assert(FormatArg < char const * >::signature == TupleIndex < char *, SupportedTypes >::value + 1, "Format signature does not match type id");
+    static_assert(FormatArg < InternedString >::signature == TupleIndex < NanoLogLine::interned_t, SupportedTypes >::value + 1, "Format signature does not match type id");
+    static_assert(NanoLogLine::format_type_id == TupleIndex < NanoLogLine::format_t, SupportedTypes >::value, "Format type id does not match");
+
+    std::atomic < unsigned int > outputformat = { static_cast < unsigned int >(OutputFormat::TEXT) };
+    std::atomic < uint32_t > coalesce_window_ms = { 0 };
+
+    /*
+     * The level check only looks at the low byte, the effective level. Above it are kept the
+     * level set by set_log_level() and the one imposed by the verbosity governor, the effective
+     * level is the higher of the two. The top 16 bits are a generation, bumped whenever
+     * producers are pointed at another buffer, so they can cache the buffer per thread.
+     */
+    std::atomic < unsigned int > loglevel = {0};
+    constexpr const unsigned int user_level_shift = 8;
+    constexpr const unsigned int governor_level_shift = 12;
+    constexpr const unsigned int generation_shift = 16;
+
+    void update_loglevel(unsigned int shift, unsigned int level)
+    {
+	unsigned int word = loglevel.load(std::memory_order_relaxed);
+	unsigned int next;
+	do
+	{
+	    next = (word & ~(0xfu << shift)) | level << shift;
+	    next = (next & ~0xffu) | std::max(next >> user_level_shift & 0xf, next >> governor_level_shift & 0xf);
+	} while (!loglevel.compare_exchange_weak(word, next, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // See govern_verbosity(), a level of INFO means off
+    std::atomic < unsigned int > governor_level = {0};
+    std::atomic < uint32_t > governor_raise_percent = { 75 };
+    std::atomic < uint32_t > governor_restore_percent = { 25 };
+
+    /*
+     * Lock free open addressing hash table of interned strings, the id is the slot index.
+     * A slot is claimed by CAS on its hash, the copy of the text is published after that,
+     * so a reader that matches the hash waits for the text before comparing. Slots are never
+     * released, the copies live until exit.
+     */
+    class InternTable
+    {
+    public:
+	static constexpr const uint32_t capacity = 1 << 16;
+	static constexpr const uint32_t max_strings = capacity / 4 * 3;    // Keeps probe sequences short
+	static constexpr const uint32_t invalid_id = std::numeric_limits < uint32_t >::max();
+	static constexpr const uint32_t unknown_id = capacity;	// An id from another process
+
+	static uint64_t hash(char const * s, size_t length)
+	{
+	    uint64_t h = 14695981039346656037ull;    // FNV-1a
+	    for (size_t i = 0; i < length; ++i)
+		h = (h ^ static_cast < unsigned char >(s[i])) * 1099511628211ull;
+	    return h != 0 ? h : 1;    // 0 marks an empty slot
+	}
+
+	/* Returns the slot of s, claiming one if it is new. invalid_id if the table is full. */
+	uint32_t insert(char const * s, uint32_t length, uint64_t h)
+	{
+	    char * copy = nullptr;
+	    for (uint32_t id = static_cast < uint32_t >(h) & (capacity - 1); ; id = (id + 1) & (capacity - 1))
+	    {
+		Slot & slot = m_slots[id];
+		uint64_t slot_hash = slot.hash.load(std::memory_order_acquire);
+		if (slot_hash == 0)
+		{
+		    if (m_count.fetch_add(1, std::memory_order_relaxed) >= max_strings)
+		    {
+			m_count.fetch_sub(1, std::memory_order_relaxed);
+			delete [] copy;
+			return invalid_id;
+		    }
+		    if (slot.hash.compare_exchange_strong(slot_hash, h, std::memory_order_acq_rel))
+		    {
+			if (copy == nullptr)
+			{
+			    copy = new char[length + 1];
+			    memcpy(copy, s, length);
+			    copy[length] = '\0';
+			}
+			slot.length = length;
+			slot.text.store(copy, std::memory_order_release);
+			return id;
+		    }
+		    m_count.fetch_sub(1, std::memory_order_relaxed);
+		    // Lost the race, slot_hash now holds the winner's hash.
+		}
+		if (slot_hash == h)
+		{
+		    char const * text;
+		    while ((text = slot.text.load(std::memory_order_acquire)) == nullptr)
+			std::this_thread::yield();
+		    if (slot.length == length && memcmp(text, s, length) == 0)
+		    {
+			delete [] copy;
+			return id;
+		    }
+		}
+	    }
+	}
+
+	/* Text of id, nullptr if there is none */
+	char const * text(uint32_t id, uint32_t & length) const
+	{
+	    if (id >= capacity)
+		return nullptr;
+	    char const * text = m_slots[id].text.load(std::memory_order_acquire);
+	    if (text != nullptr)
+		length = m_slots[id].length;
+	    return text;
+	}
+
+    private:
+	struct Slot
+	{
+	    std::atomic < uint64_t > hash;
+	    std::atomic < char const * > text;
+	    uint32_t length;    // Written before text is published
+	};
+
+	Slot m_slots[capacity];
+	std::atomic < uint32_t > m_count = { 0 };
+    };
+
+    InternTable intern_table;
+
+    // Ids are meaningless to a collector in another process, SharedMemoryLogger turns this off.
+    std::atomic < bool > intern_enabled = { true };
+
+    /* Direct mapped per thread cache in front of intern_table, a hit costs a hash and a memcmp */
+    struct InternCache
+    {
+	static constexpr const size_t size = 256;
+
+	struct Entry
+	{
+	    uint64_t hash;
+	    char const * text;
+	    uint32_t length;
+	    uint32_t id;
+	};
+
+	Entry entries[size];
+    };
+
+    InternedString intern(char const * s, size_t length)
+    {
+	if (length >= std::numeric_limits < uint32_t >::max() || !intern_enabled.load(std::memory_order_relaxed))
+	    return InternedString{ s, length, InternTable::invalid_id };
+	static thread_local InternCache cache = {};
+	uint64_t const h = InternTable::hash(s, length);
+	InternCache::Entry & entry = cache.entries[h & (InternCache::size - 1)];
+	if (entry.hash == h && entry.length == length && memcmp(entry.text, s, length) == 0)
+	    return InternedString{ entry.text, length, entry.id };
+
+	uint32_t const id = intern_table.insert(s, static_cast < uint32_t >(length), h);
+	if (id == InternTable::invalid_id)
+	    return InternedString{ s, length, id };
+	uint32_t text_length = 0;
+	char const * text = intern_table.text(id, text_length);
+	entry = InternCache::Entry{ h, text, static_cast < uint32_t >(length), id };
+	return InternedString{ text, length, id };
+    }
+
+    InternedString intern(char const * s)
+    {
+	return intern(s, strlen(s));
+    }
+
+    InternedString intern(std::string const & s)
+    {
+	return intern(s.data(), s.size());
+    }
 
     char const * to_string(LogLevel loglevel)
     {
@@ -119,7 +443,7 @@ namespace nanolog
 	, m_buffer_size(sizeof(m_stack_buffer))
     {
 	encode < uint64_t >(timestamp_now());
-	encode < std::thread::id >(this_thread_id());
+	encode < uint32_t >(this_thread_id());
 	encode < string_literal_t >(string_literal_t(file));
 	encode < string_literal_t >(string_literal_t(function));
 	encode < uint32_t >(line);
@@ -128,12 +452,489 @@ namespace nanolog
 
     NanoLogLine::~NanoLogLine() = default;
 
+    uint64_t NanoLogLine::timestamp() const
+    {
+	return *reinterpret_cast < uint64_t const * >(!m_heap_buffer ? m_stack_buffer : m_heap_buffer.get());
+    }
+
+    /*
+     * Raw access to the encoded bytes of a NanoLogLine, for consumer side code which
+     * needs to inspect or rewrite a record without formatting it.
+     */
+    struct RecordCodec
+    {
+	// timestamp, thread id, file, function, line, level
+	static constexpr const size_t header_size = sizeof(uint64_t) + sizeof(uint32_t) + 2 * sizeof(NanoLogLine::string_literal_t) + sizeof(uint32_t) + sizeof(LogLevel);
+	static constexpr const size_t file_offset = sizeof(uint64_t) + sizeof(uint32_t);
+	static constexpr const size_t level_offset = header_size - sizeof(LogLevel);
+
+	static char * begin(NanoLogLine & logline)
+	{
+	    return !logline.m_heap_buffer ? logline.m_stack_buffer : logline.m_heap_buffer.get();
+	}
+
+	static char * end(NanoLogLine & logline)
+	{
+	    return begin(logline) + logline.m_bytes_used;
+	}
+
+	/* Returns the position of the argument following the one of type type_id at b, nullptr for an unknown type */
+	static char * skip(int type_id, char * b)
+	{
+	    switch (type_id)
+	    {
+	    case 0:
+		return b + sizeof(std::tuple_element < 0, SupportedTypes >::type);
+	    case 1:
+		return b + sizeof(std::tuple_element < 1, SupportedTypes >::type);
+	    case 2:
+		return b + sizeof(std::tuple_element < 2, SupportedTypes >::type);
+	    case 3:
+		return b + sizeof(std::tuple_element < 3, SupportedTypes >::type);
+	    case 4:
+		return b + sizeof(std::tuple_element < 4, SupportedTypes >::type);
+	    case 5:
+		return b + sizeof(std::tuple_element < 5, SupportedTypes >::type);
+	    case 6:
+		return b + sizeof(std::tuple_element < 6, SupportedTypes >::type);
+	    case 7:
+		return b + sizeof(uint32_t) + *reinterpret_cast < uint32_t * >(b);
+	    case 8:
+		return b + sizeof(std::tuple_element < 8, SupportedTypes >::type);
+	    case 9:
+		return b + sizeof(std::tuple_element < 9, SupportedTypes >::type);
+	    case 10:
+		return for_each_format_arg(b, [](int, char *) {});
+	    }
+	    return nullptr;
+	}
+
+	/* As skip(), for an argument of a format line. Interned strings carry their text if the intern table was full. */
+	static char * skip_format_arg(int type_id, char * b)
+	{
+	    if (type_id != TupleIndex < NanoLogLine::interned_t, SupportedTypes >::value)
+		return skip(type_id, b);
+	    b += sizeof(NanoLogLine::interned_t);
+	    return reinterpret_cast < NanoLogLine::interned_t * >(b - sizeof(NanoLogLine::interned_t))->m_id == InternTable::invalid_id ? skip(TupleIndex < char *, SupportedTypes >::value, b) : b;
+	}
+
+	/* Calls f(type_id, char * value) for every argument of the format line at b, returns the position after them */
+	template < typename Function >
+	static char * for_each_format_arg(char * b, Function f)
+	{
+	    char const * signature = reinterpret_cast < NanoLogLine::format_t * >(b)->m_signature;
+	    b += sizeof(NanoLogLine::format_t);
+	    for (; *signature != '\0' && b != nullptr; ++signature)
+	    {
+		int const type_id = *signature - 1;
+		f(type_id, b);
+		b = skip_format_arg(type_id, b);
+	    }
+	    return b;
+	}
+
+	/* Interned ids mean nothing outside the process which logged them, makes them print as unknown */
+	static void forget_interned(NanoLogLine & logline)
+	{
+	    int const interned = TupleIndex < NanoLogLine::interned_t, SupportedTypes >::value;
+	    auto forget = [](int type_id, char * b)
+	    {
+		NanoLogLine::interned_t * id = reinterpret_cast < NanoLogLine::interned_t * >(b);
+		if (type_id == interned && id->m_id != InternTable::invalid_id)
+		    id->m_id = InternTable::unknown_id;
+	    };
+	    char * b = begin(logline) + header_size;
+	    for (char const * const e = end(logline); b != nullptr && b < e; )
+	    {
+		int const type_id = static_cast < int >(*b++);
+		if (type_id == NanoLogLine::format_type_id)
+		{
+		    b = for_each_format_arg(b, forget);
+		    continue;
+		}
+		forget(type_id, b);
+		b = skip(type_id, b);
+	    }
+	}
+
+	/* Calls f(char const * &) on every string literal of the record, file, function and keys included */
+	template < typename Function >
+	static void for_each_literal(NanoLogLine & logline, Function f)
+	{
+	    char * b = begin(logline);
+	    char const * const e = end(logline);
+	    f(reinterpret_cast < NanoLogLine::string_literal_t * >(b + file_offset)->m_s);
+	    f(reinterpret_cast < NanoLogLine::string_literal_t * >(b + file_offset + sizeof(NanoLogLine::string_literal_t))->m_s);
+	    for (b += header_size; b != nullptr && b < e; )
+	    {
+		int const type_id = static_cast < int >(*b++);
+		if (type_id == TupleIndex < NanoLogLine::string_literal_t, SupportedTypes >::value)
+		    f(reinterpret_cast < NanoLogLine::string_literal_t * >(b)->m_s);
+		else if (type_id == TupleIndex < NanoLogLine::field_key_t, SupportedTypes >::value)
+		    f(reinterpret_cast < NanoLogLine::field_key_t * >(b)->m_s);
+		else if (type_id == NanoLogLine::format_type_id)
+		{
+		    // The signature is resolved before it is walked.
+		    NanoLogLine::format_t * format = reinterpret_cast < NanoLogLine::format_t * >(b);
+		    f(format->m_format);
+		    f(format->m_signature);
+		    b = for_each_format_arg(b, [&f](int type_id, char * value)
+		    {
+			if (type_id == TupleIndex < NanoLogLine::string_literal_t, SupportedTypes >::value)
+			    f(reinterpret_cast < NanoLogLine::string_literal_t * >(value)->m_s);
+		    });
+		    continue;
+		}
+		b = skip(type_id, b);
+	    }
+	}
+
+	/* Call site, level and arguments, everything which follows the timestamp and thread id */
+	static char const * call_site(NanoLogLine & logline)
+	{
+	    return begin(logline) + file_offset;
+	}
+
+	static uint32_t thread_id(NanoLogLine & logline)
+	{
+	    return *reinterpret_cast < uint32_t * >(begin(logline) + sizeof(uint64_t));
+	}
+
+	/* Rewrites the header of logline, call site and level copied from the call_site() of another record */
+	static void set_header(NanoLogLine & logline, uint64_t timestamp, uint32_t thread_id, char const * call_site)
+	{
+	    char * b = begin(logline);
+	    memcpy(b, &timestamp, sizeof(timestamp));
+	    memcpy(b + sizeof(uint64_t), &thread_id, sizeof(thread_id));
+	    memcpy(b + file_offset, call_site, header_size - file_offset);
+	}
+
+	/*
+	 * Copies the record out of the image of a NanoLogLine left behind by another process.
+	 * Returns false if the arguments had spilled to the heap, only the header is kept then.
+	 */
+	static bool restore(NanoLogLine & logline, NanoLogLine const & image)
+	{
+	    bool const complete = !image.m_heap_buffer && image.m_bytes_used >= header_size && image.m_bytes_used <= sizeof(image.m_stack_buffer);
+	    logline.m_heap_buffer.reset();
+	    logline.m_buffer_size = sizeof(logline.m_stack_buffer);
+	    logline.m_bytes_used = complete ? image.m_bytes_used : header_size;
+	    memcpy(logline.m_stack_buffer, image.m_stack_buffer, logline.m_bytes_used);
+	    return complete;
+	}
+    };
+
+    LogLevel NanoLogLine::level() const
+    {
+	return *reinterpret_cast < LogLevel const * >((!m_heap_buffer ? m_stack_buffer : m_heap_buffer.get()) + RecordCodec::level_offset);
+    }
+
+    /*
+     * Length of the prefix of s free of characters c <= max_control and of the special characters.
+     * Scans 16 bytes at a time with SSE2.
+     */
+    size_t plain_prefix(char const * s, size_t length, unsigned char max_control, char const (&special)[3])
+    {
+	size_t i = 0;
+#if defined(__SSE2__)
+	__m128i const control = _mm_set1_epi8(static_cast < char >(max_control));
+	__m128i const special0 = _mm_set1_epi8(special[0]);
+	__m128i const special1 = _mm_set1_epi8(special[1]);
+	__m128i const special2 = _mm_set1_epi8(special[2]);
+	for (; i + 16 <= length; i += 16)
+	{
+	    __m128i const chunk = _mm_loadu_si128(reinterpret_cast < __m128i const * >(s + i));
+	    __m128i const is_control = _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk);
+	    __m128i const is_special = _mm_or_si128(_mm_cmpeq_epi8(chunk, special0), _mm_or_si128(_mm_cmpeq_epi8(chunk, special1), _mm_cmpeq_epi8(chunk, special2)));
+	    int const mask = _mm_movemask_epi8(_mm_or_si128(is_control, is_special));
+	    if (mask != 0)
+		return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < length; ++i)
+	{
+	    unsigned char const c = static_cast < unsigned char >(s[i]);
+	    if (c <= max_control || s[i] == special[0] || s[i] == special[1] || s[i] == special[2])
+		return i;
+	}
+	return length;
+    }
+
+    char const json_special[3] = { '"', '\\', '"' };
+    char const logfmt_special[3] = { '=', '"', '\x7f' };
+
+    /* Writes s with the characters JSON does not allow inside a string escaped. Unescaped runs are written in one go. */
+    void write_escaped(std::ostream & os, char const * s, size_t length)
+    {
+	static char const hex[] = "0123456789abcdef";
+	char const * const end = s + length;
+	while (s != end)
+	{
+	    size_t const plain = plain_prefix(s, end - s, 0x1f, json_special);
+	    os.write(s, plain);
+	    s += plain;
+	    if (s == end)
+		break;
+	    unsigned char const c = static_cast < unsigned char >(*s++);
+	    switch (c)
+	    {
+	    case '"':
+		os.write("\\\"", 2);
+		break;
+	    case '\\':
+		os.write("\\\\", 2);
+		break;
+	    case '\n':
+		os.write("\\n", 2);
+		break;
+	    case '\r':
+		os.write("\\r", 2);
+		break;
+	    case '\t':
+		os.write("\\t", 2);
+		break;
+	    default:
+		{
+		    char const escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+		    os.write(escaped, sizeof(escaped));
+		}
+	    }
+	}
+    }
+
+    /* logfmt values are bare unless they are empty or contain spaces, quotes, '=' or control characters */
+    bool needs_quotes(char const * s, size_t length)
+    {
+	return length == 0 || plain_prefix(s, length, ' ', logfmt_special) != length;
+    }
+
+    /* A string value. in_string - we are inside an already quoted value, e.g. msg. */
+    void write_text(std::ostream & os, char const * s, size_t length, bool in_string, OutputFormat format)
+    {
+	if (format == OutputFormat::TEXT)
+	    os.write(s, length);
+	else if (!in_string && (format == OutputFormat::JSON || needs_quotes(s, length)))
+	{
+	    os.put('"');
+	    write_escaped(os, s, length);
+	    os.put('"');
+	}
+	else if (in_string)
+	    write_escaped(os, s, length);
+	else
+	    os.write(s, length);
+    }
+
+    template < typename Number >
+    char * write_number(std::ostream & os, char * b)
+    {
+	os << *reinterpret_cast < Number * >(b);
+	return b + sizeof(Number);
+    }
+
+    char * write_format(std::ostream & os, char * b, OutputFormat format);
+
+    /*
+     * Writes the argument of type type_id at b as a structured value. Numbers are bare,
+     * except NaN / infinities which JSON has no literal for. Returns the position of the next argument.
+     */
+    char * write_value(std::ostream & os, int type_id, char * b, bool in_string, OutputFormat format)
+    {
+	switch (type_id)
+	{
+	case 0:
+	    write_text(os, b, 1, in_string, format);
+	    return b + 1;
+	case 1:
+	    return write_number < std::tuple_element < 1, SupportedTypes >::type >(os, b);
+	case 2:
+	    return write_number < std::tuple_element < 2, SupportedTypes >::type >(os, b);
+	case 3:
+	    return write_number < std::tuple_element < 3, SupportedTypes >::type >(os, b);
+	case 4:
+	    return write_number < std::tuple_element < 4, SupportedTypes >::type >(os, b);
+	case 5:
+	    {
+		double const d = *reinterpret_cast < double * >(b);
+		if (!in_string && format == OutputFormat::JSON && !std::isfinite(d))
+		    write_text(os, std::isnan(d) ? "NaN" : d > 0 ? "Infinity" : "-Infinity", std::isnan(d) ? 3 : d > 0 ? 8 : 9, false, format);
+		else
+		    os << d;
+		return b + sizeof(double);
+	    }
+	case 6:
+	    {
+		char const * s = reinterpret_cast < NanoLogLine::string_literal_t * >(b)->m_s;
+		write_text(os, s, strlen(s), in_string, format);
+		return b + sizeof(NanoLogLine::string_literal_t);
+	    }
+	case 7:
+	    {
+		uint32_t const length = *reinterpret_cast < uint32_t * >(b);
+		write_text(os, b + sizeof(uint32_t), length, in_string, format);
+		return b + sizeof(uint32_t) + length;
+	    }
+	case 9:
+	    {
+		uint32_t length = 0;
+		char const * s = intern_table.text(reinterpret_cast < NanoLogLine::interned_t * >(b)->m_id, length);
+		if (s == nullptr)
+		    write_text(os, "<unknown interned string>", 25, in_string, format);
+		else
+		    write_text(os, s, length, in_string, format);
+		return b + sizeof(NanoLogLine::interned_t);
+	    }
+	case 10:
+	    return write_format(os, b, format);
+	}
+	return nullptr;
+    }
+
+    /* Writes the format string of a format line with each {} replaced by the next argument, in msg unless TEXT */
+    char * write_format(std::ostream & os, char * b, OutputFormat format)
+    {
+	int const interned = TupleIndex < NanoLogLine::interned_t, SupportedTypes >::value;
+	NanoLogLine::format_t const line = *reinterpret_cast < NanoLogLine::format_t * >(b);
+	char const * signature = line.m_signature;
+	char const * run = line.m_format;
+	b += sizeof(NanoLogLine::format_t);
+	for (char const * s = run; *s != '\0'; ++s)
+	{
+	    if (s[0] != '{' || s[1] != '}' || *signature == '\0')
+		continue;
+	    write_text(os, run, s - run, true, format);
+	    int const type_id = *signature++ - 1;
+	    if (type_id == interned && reinterpret_cast < NanoLogLine::interned_t * >(b)->m_id == InternTable::invalid_id)
+		b = write_value(os, TupleIndex < char *, SupportedTypes >::value, b + sizeof(NanoLogLine::interned_t), true, format);
+	    else
+		b = write_value(os, type_id, b, true, format);
+	    if (b == nullptr)
+		return nullptr;
+	    run = ++s + 1;
+	}
+	write_text(os, run, strlen(run), true, format);
+	return b;
+    }
+
+    void write_key(std::ostream & os, char const * key, OutputFormat format, bool first)
+    {
+	if (format == OutputFormat::JSON)
+	{
+	    os.write(first ? "{\"" : ",\"", 2);
+	    write_escaped(os, key, strlen(key));
+	    os.write("\":", 2);
+	}
+	else
+	{
+	    if (!first)
+		os.put(' ');
+	    os << key << '=';
+	}
+    }
+
+    /*
+     * One JSON object / logfmt line per record. The header becomes ts, level, thread,
+     * file, function and line, the plain arguments are joined into msg and every kv()
+     * becomes a field of its own.
+     */
+    void stringify_structured(std::ostream & os, NanoLogLine & logline, OutputFormat format)
+    {
+	int const key_type = TupleIndex < NanoLogLine::field_key_t, SupportedTypes >::value;
+	char * b = RecordCodec::begin(logline);
+	char * const end = RecordCodec::end(logline);
+	uint64_t timestamp = *reinterpret_cast < uint64_t * >(b); b += sizeof(uint64_t);
+	uint32_t threadid = *reinterpret_cast < uint32_t * >(b); b += sizeof(uint32_t);
+	char const * file = reinterpret_cast < NanoLogLine::string_literal_t * >(b)->m_s; b += sizeof(NanoLogLine::string_literal_t);
+	char const * function = reinterpret_cast < NanoLogLine::string_literal_t * >(b)->m_s; b += sizeof(NanoLogLine::string_literal_t);
+	uint32_t line = *reinterpret_cast < uint32_t * >(b); b += sizeof(uint32_t);
+	LogLevel loglevel = *reinterpret_cast < LogLevel * >(b); b += sizeof(LogLevel);
+
+	char ts[32];
+	format_timestamp_iso8601(ts, timestamp);
+	write_key(os, "ts", format, true);
+	write_text(os, ts, strlen(ts), false, format);
+	write_key(os, "level", format, false);
+	write_text(os, to_string(loglevel), 4, false, format);
+	// Always text, so a JSON consumer sees one type whether the thread is named or not.
+	write_key(os, "thread", format, false);
+	if (std::string const * name = thread_names.lookup(threadid, timestamp))
+	    write_text(os, name->data(), name->size(), false, format);
+	else
+	{
+	    char id[16];
+	    int const length = snprintf(id, sizeof(id), "%u", threadid);
+	    write_text(os, id, length, false, format);
+	}
+	write_key(os, "file", format, false);
+	write_text(os, file, strlen(file), false, format);
+	write_key(os, "function", format, false);
+	write_text(os, function, strlen(function), false, format);
+	write_key(os, "line", format, false);
+	os << line;
+
+	bool message = false;
+	bool separate = false;    // A kv() was left out of the message here
+	for (char * a = b; a != nullptr && a < end; )
+	{
+	    int const type_id = static_cast < int >(*a++);
+	    if (type_id == key_type)
+	    {
+		a += sizeof(NanoLogLine::field_key_t);
+		if (a < end && *a != key_type)
+		    a = RecordCodec::skip(*a, a + 1);
+		separate = message;
+		continue;
+	    }
+	    if (!message)
+	    {
+		write_key(os, "msg", format, false);
+		os.put('"');
+		message = true;
+	    }
+	    else if (separate)
+	    {
+		os.put(' ');
+	    }
+	    separate = false;
+	    a = write_value(os, type_id, a, true, format);
+	}
+	if (message)
+	    os.put('"');
+
+	for (char * a = b; a != nullptr && a < end; )
+	{
+	    int const type_id = static_cast < int >(*a++);
+	    if (type_id != key_type)
+	    {
+		a = RecordCodec::skip(type_id, a);
+		continue;
+	    }
+	    write_key(os, reinterpret_cast < NanoLogLine::field_key_t * >(a)->m_s, format, false);
+	    a += sizeof(NanoLogLine::field_key_t);
+	    if (a == end || *a == key_type)
+		write_text(os, "", 0, false, format);    // The value encoded to nothing, e.g. an empty string
+	    else
+		a = write_value(os, *a, a + 1, false, format);
+	}
+
+	if (format == OutputFormat::JSON)
+	    os.put('}');
+	os.put('\n');
+    }
+
     void NanoLogLine::stringify(std::ostream & os)
     {
+	OutputFormat const format = static_cast < OutputFormat >(outputformat.load(std::memory_order_relaxed));
+	if (format != OutputFormat::TEXT)
+	{
+	    stringify_structured(os, *this, format);
+	    return;
+	}
+
 	char * b = !m_heap_buffer ? m_stack_buffer : m_heap_buffer.get();
 	char const * const end = b + m_bytes_used;
 	uint64_t timestamp = *reinterpret_cast < uint64_t * >(b); b += sizeof(uint64_t);
-	std::thread::id threadid = *reinterpret_cast < std::thread::id * >(b); b += sizeof(std::thread::id);
+	uint32_t threadid = *reinterpret_cast < uint32_t * >(b); b += sizeof(uint32_t);
 	string_literal_t file = *reinterpret_cast < string_literal_t * >(b); b += sizeof(string_literal_t);
 	string_literal_t function = *reinterpret_cast < string_literal_t * >(b); b += sizeof(string_literal_t);
 	uint32_t line = *reinterpret_cast < uint32_t * >(b); b += sizeof(uint32_t);
@@ -141,16 +942,14 @@ namespace nanolog
 
 	format_timestamp(os, timestamp);
 
-	os << '[' << to_string(loglevel) << ']'
-	   << '[' << threadid << ']'
+	os << '[' << to_string(loglevel) << ']' << '[';
+	thread_names.print(os, threadid, timestamp);
+	os << ']'
 	   << '[' << file.m_s << ':' << function.m_s << ':' << line << "] ";
 
 	stringify(os, b, end);
 
-	os << std::endl;
-
-	if (loglevel >= LogLevel::CRIT)
-	    os.flush();
+	os << '\n';
     }
 
     template < typename Arg >
@@ -169,15 +968,23 @@ namespace nanolog
 	return b + sizeof(NanoLogLine::string_literal_t);
     }
 
+    template <>
+    char * decode(std::ostream & os, char * b, NanoLogLine::interned_t * dummy)
+    {
+	uint32_t length = 0;
+	if (char const * s = intern_table.text(reinterpret_cast < NanoLogLine::interned_t * >(b)->m_id, length))
+	    os.write(s, length);
+	else
+	    os << "<unknown interned string>";
+	return b + sizeof(NanoLogLine::interned_t);
+    }
+
     template <>
     char * decode(std::ostream & os, char * b, char ** dummy)
     {
-	while (*b != '\0')
-	{
-	    os << *b;
-	    ++b;
-	}
-	return ++b;
+	uint32_t const length = *reinterpret_cast < uint32_t * >(b);
+	os.write(b + sizeof(uint32_t), length);
+	return b + sizeof(uint32_t) + length;
     }
 
     void NanoLogLine::stringify(std::ostream & os, char * start, char const * const end)
@@ -213,8 +1020,34 @@ namespace nanolog
 	case 7:
 	    stringify(os, decode(os, start, static_cast<std::tuple_element<7, SupportedTypes>::type*>(nullptr)), end);
 	    return;
+	case 8:
+	{
+	    // key=value, apart from whatever comes before and after it
+	    if (start - 1 != (!m_heap_buffer ? m_stack_buffer : m_heap_buffer.get()) + RecordCodec::header_size)
+		os << ' ';
+	    os << reinterpret_cast < field_key_t * >(start)->m_s << '=';
+	    char * value = start + sizeof(field_key_t);
+	    char * next = value == end || *value == type_id ? nullptr : RecordCodec::skip(*value, value + 1);
+	    if (next == nullptr)
+	    {
+		stringify(os, value, end);
+		return;
+	    }
+	    stringify(os, value, next);
+	    if (next != end && *next != type_id)
+		os << ' ';
+	    stringify(os, next, end);
+	    return;
 	}
-    }
+	case 9:
+	    stringify(os, decode(os, start, static_cast<std::tuple_element<9, SupportedTypes>::type*>(nullptr)), end);
+	    return;
+	case 10:
+	    if (char * next = write_format(os, start, OutputFormat::TEXT))
+		stringify(os, next, end);
+	    return;
+	}
+    }
 
     char * NanoLogLine::buffer()
     {
@@ -256,17 +1089,20 @@ namespace nanolog
 	    encode_c_string(arg, strlen(arg));
     }
 
+    /* Strings are stored length prefixed, so they are decoded with a single write */
     void NanoLogLine::encode_c_string(char const * arg, size_t length)
     {
 	if (length == 0)
 	    return;
 	
-	resize_buffer_if_needed(1 + length + 1);
+	uint32_t const stored = static_cast < uint32_t >(std::min < size_t >(length, std::numeric_limits < uint32_t >::max()));
+	resize_buffer_if_needed(1 + sizeof(uint32_t) + stored);
 	char * b = buffer();
 	auto type_id = TupleIndex < char *, SupportedTypes >::value;
 	*reinterpret_cast<uint8_t*>(b++) = static_cast<uint8_t>(type_id);
-	memcpy(b, arg, length + 1);
-	m_bytes_used += 1 + length + 1;
+	*reinterpret_cast<uint32_t*>(b) = stored;
+	memcpy(b + sizeof(uint32_t), arg, stored);
+	m_bytes_used += 1 + sizeof(uint32_t) + stored;
     }
 
     void NanoLogLine::encode(string_literal_t arg)
@@ -274,12 +1110,32 @@ namespace nanolog
 	encode < string_literal_t >(arg, TupleIndex < string_literal_t, SupportedTypes >::value);
     }
 
+    void NanoLogLine::encode(field_key_t arg)
+    {
+	encode < field_key_t >(arg, TupleIndex < field_key_t, SupportedTypes >::value);
+    }
+
+    NanoLogLine& NanoLogLine::operator<<(InternedString const & arg)
+    {
+	if (arg.id != InternTable::invalid_id)
+	    encode < interned_t >(interned_t(arg.id), TupleIndex < interned_t, SupportedTypes >::value);
+	else
+	    encode_c_string(arg.text, arg.length);
+	return *this;
+    }
+
     NanoLogLine& NanoLogLine::operator<<(std::string const & arg)
     {
 	encode_c_string(arg.c_str(), arg.length());
 	return *this;
     }
 
+    NanoLogLine& NanoLogLine::operator<<(StringRef const & arg)
+    {
+	encode_c_string(arg.data, arg.length);
+	return *this;
+    }
+
     NanoLogLine& NanoLogLine::operator<<(int32_t arg)
     {
 	encode < int32_t >(arg, TupleIndex < int32_t, SupportedTypes >::value);
@@ -316,11 +1172,80 @@ namespace nanolog
 	return *this;
     }
 
+    /*
+     * Producer side counters are sharded. Each thread picks a shard on first use,
+     * so an increment only shares its cache line with a few other threads.
+     */
+    struct alignas(64) ProducerCounters
+    {
+	std::atomic < uint64_t > enqueued;
+	std::atomic < uint64_t > dropped;
+    };
+
+    struct Metrics
+    {
+	static constexpr const size_t shards = 32;
+
+	ProducerCounters producer[shards];
+	std::atomic < unsigned int > next_shard;
+
+	alignas(64) std::atomic < uint64_t > buffer_count;
+	std::atomic < uint64_t > buffer_high_water_mark;
+
+	// Only written by the background thread
+	alignas(64) std::atomic < uint64_t > lines_written;
+	std::atomic < uint64_t > consumer_lag_us;
+	std::atomic < uint64_t > max_consumer_lag_us;
+	std::atomic < uint64_t > bytes_written;
+	std::atomic < uint64_t > roll_count;
+	std::atomic < uint64_t > lines_coalesced;
+	std::atomic < uint64_t > write_latency_ns[Stats::write_latency_buckets];
+    };
+
+    // Static storage, so every counter starts zeroed.
+    Metrics metrics;
+
+    ProducerCounters & producer_counters()
+    {
+	static thread_local ProducerCounters & counters = metrics.producer[metrics.next_shard.fetch_add(1, std::memory_order_relaxed) % Metrics::shards];
+	return counters;
+    }
+
+    void increment(std::atomic < uint64_t > & counter, uint64_t value = 1)
+    {
+	counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void update_max(std::atomic < uint64_t > & counter, uint64_t value)
+    {
+	uint64_t current = counter.load(std::memory_order_relaxed);
+	while (value > current && !counter.compare_exchange_weak(current, value, std::memory_order_relaxed));
+    }
+
+    /* The buffers producers push to without a virtual call, see ProducerHandle */
+    enum class BufferKind : uint8_t { RING, QUEUE, OTHER };
+
     struct BufferBase
     {
 	virtual ~BufferBase() = default;
+	virtual BufferKind kind() const { return BufferKind::OTHER; }
+	/* The buffer producers actually push to, this one unless it wraps another */
+	virtual BufferBase * target() { return this; }
     	virtual void push(NanoLogLine && logline) = 0;
 	virtual bool try_pop(NanoLogLine & logline) = 0;
+	/* Called on the consumer thread once every line popped so far is flushed to the log file */
+	virtual void on_flush() {}
+	/* Called regularly on the consumer thread */
+	virtual void reserve() {}
+	/* Lines queued before producers lose lines or the buffer has to grow, 0 if unknown */
+	virtual uint32_t capacity() const { return 0; }
+	/*
+	 * Sequence numbers for flush barriers, compared modulo 2^32.
+	 * claimed() - one past the last slot handed out to a producer. Any thread.
+	 * consumed() - every line claimed before it was popped or overwritten. Consumer thread only.
+	 */
+	virtual uint32_t claimed() = 0;
+	virtual uint32_t consumed() const = 0;
     };
 
     struct SpinLock
@@ -339,205 +1264,999 @@ namespace nanolog
 	std::atomic_flag & m_flag;
     };
 
+    /*
+     * Writes one byte per page, so the pages get placed on the NUMA node of the calling thread.
+     * Through a volatile pointer - a memset(0) after malloc is turned into calloc by the compiler.
+     */
+    void touch_pages(void * memory, size_t bytes)
+    {
+	static size_t const page_size = static_cast < size_t >(::sysconf(_SC_PAGESIZE));
+	volatile char * const p = static_cast < volatile char * >(memory);
+	for (size_t offset = 0; offset < bytes; offset += page_size)
+	    p[offset] = 0;
+    }
+
+    struct JournalSegment
+    {
+	uint64_t vaddr;
+	uint64_t filesz;
+	uint64_t offset;
+    };
+
+    /* A loaded object file, used to resolve string literal pointers after the process died */
+    struct JournalModule
+    {
+	char path[256];
+	uint64_t bias;
+	uint32_t segment_count;
+	JournalSegment segments[8];
+    };
+
+    struct JournalHeader
+    {
+	static constexpr const size_t max_modules = 128;
+	static constexpr const size_t items_offset = 64 * 1024;
+	static constexpr const uint32_t current_version = 4;	// Bump when the record layout changes
+
+	char magic[8];
+	uint32_t version;
+	uint32_t item_size;
+	uint64_t slots;
+	uint64_t pid;
+	std::atomic < uint32_t > flushed;	// SharedMemoryLogger - how far the collector has written
+	uint64_t module_count;
+	JournalModule modules[max_modules];
+    };
+
+    static_assert(sizeof(JournalHeader) <= JournalHeader::items_offset, "Journal header overlaps items");
+
+    char const journal_magic[8] = { 'N', 'A', 'N', 'O', 'J', 'R', 'N', 'L' };
+
+    /*
+     * File backed storage for the RingBuffer. The kernel keeps the pages of a shared
+     * mapping when the process dies, so lines still queued at the time of a crash
+     * can be decoded afterwards by recover_crash_journal().
+     */
+    class CrashJournal
+    {
+    public:
+	CrashJournal(std::string const & path, size_t item_size, size_t slots)
+	    : m_path(path)
+	    , m_size(JournalHeader::items_offset + item_size * slots)
+	    , m_fd(create(path))
+	{
+	    if (m_fd == -1)
+		throw std::system_error(errno, std::generic_category(), "Cannot open crash journal " + path);
+	    if (::ftruncate(m_fd, m_size) != 0)
+	    {
+		int const error = errno;
+		::close(m_fd);
+		throw std::system_error(error, std::generic_category(), "Cannot size crash journal " + path);
+	    }
+	    m_memory = static_cast < char * >(::mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0));
+	    if (m_memory == MAP_FAILED)
+	    {
+		int const error = errno;
+		::close(m_fd);
+		throw std::system_error(error, std::generic_category(), "Cannot map crash journal " + path);
+	    }
+
+	    JournalHeader * header = reinterpret_cast < JournalHeader * >(m_memory);
+	    header->version = JournalHeader::current_version;
+	    header->item_size = item_size;
+	    header->slots = slots;
+	    header->pid = static_cast < uint64_t >(::getpid());
+	    header->module_count = 0;
+	    dl_iterate_phdr(&CrashJournal::add_module, header);
+	    // Last, a collector attaches to the journal once it sees the magic.
+	    std::atomic_thread_fence(std::memory_order_release);
+	    memcpy(header->magic, journal_magic, sizeof(journal_magic));
+	}
+
+	~CrashJournal()
+	{
+	    // Everything was drained on a clean shutdown, nothing left to recover.
+	    // Unless a later journal took over the path.
+	    struct stat ours, path;
+	    if (::fstat(m_fd, &ours) == 0 && ::stat(m_path.c_str(), &path) == 0 && ours.st_ino == path.st_ino && ours.st_dev == path.st_dev)
+		::unlink(m_path.c_str());
+	    ::munmap(m_memory, m_size);
+	    ::close(m_fd);
+	}
+
+	void * items()
+	{
+	    return m_memory + JournalHeader::items_offset;
+	}
+
+	JournalHeader * header()
+	{
+	    return reinterpret_cast < JournalHeader * >(m_memory);
+	}
+
+	CrashJournal(CrashJournal const &) = delete;
+	CrashJournal& operator=(CrashJournal const &) = delete;
+
+    private:
+	/*
+	 * A fresh inode every time, a buffer retired by re-initialization may still map the old one.
+	 * A journal another process left behind, e.g. the one before a supervisor restarted us,
+	 * is kept as <path>.<pid> for nanolog_recover.
+	 */
+	static int create(std::string const & path)
+	{
+	    int const fd = ::open(path.c_str(), O_RDONLY);
+	    if (fd != -1)
+	    {
+		char magic[sizeof(journal_magic)] = {};
+		uint32_t version = 0;
+		uint64_t pid = 0;
+		bool const readable = ::pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+		    && ::pread(fd, &version, sizeof(version), offsetof(JournalHeader, version)) == sizeof(version)
+		    && ::pread(fd, &pid, sizeof(pid), offsetof(JournalHeader, pid)) == sizeof(pid);
+		::close(fd);
+		bool const journal = readable && memcmp(magic, journal_magic, sizeof(magic)) == 0 && version == JournalHeader::current_version;
+		if (journal && pid == static_cast < uint64_t >(::getpid()))
+		    ::unlink(path.c_str());
+		else if (::rename(path.c_str(), (path + "." + (journal ? std::to_string(pid) : std::string("old"))).c_str()) != 0)
+		    return -1;
+	    }
+	    return ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	}
+
+	static int add_module(dl_phdr_info * info, size_t, void * data)
+	{
+	    JournalHeader * header = static_cast < JournalHeader * >(data);
+	    if (header->module_count == JournalHeader::max_modules)
+		return 1;
+
+	    JournalModule & module = header->modules[header->module_count];
+	    memset(&module, 0, sizeof(module));
+	    if (info->dlpi_name == nullptr || info->dlpi_name[0] == '\0')
+	    {
+		// The main program
+		ssize_t const length = ::readlink("/proc/self/exe", module.path, sizeof(module.path) - 1);
+		if (length <= 0)
+		    return 0;
+	    }
+	    else
+	    {
+		strncpy(module.path, info->dlpi_name, sizeof(module.path) - 1);
+	    }
+
+	    module.bias = info->dlpi_addr;
+	    for (size_t i = 0; i < info->dlpi_phnum && module.segment_count < 8; ++i)
+	    {
+		ElfW(Phdr) const & phdr = info->dlpi_phdr[i];
+		if (phdr.p_type != PT_LOAD)
+		    continue;
+		JournalSegment & segment = module.segments[module.segment_count++];
+		segment.vaddr = phdr.p_vaddr;
+		segment.filesz = phdr.p_filesz;
+		segment.offset = phdr.p_offset;
+	    }
+	    ++header->module_count;
+	    return 0;
+	}
+
+    private:
+	std::string const m_path;
+	size_t const m_size;
+	int const m_fd;
+	char * m_memory;
+    };
+
     /* Multi Producer Single Consumer Ring Buffer */
-    class RingBuffer : public BufferBase
+    class RingBuffer final : public BufferBase
     {
     public:
+	/*
+	 * Slots start out as zeroed memory - a clear flag, nothing written - and the
+	 * logline is only constructed by the first push to the slot. The pages of the
+	 * ring are not touched until then.
+	 */
     	struct alignas(64) Item
     	{
-	    Item() 
-		: flag{ ATOMIC_FLAG_INIT }
-		, written(0)
-		, logline(LogLevel::INFO, nullptr, nullptr, 0)
-	    {
-	    }
-	    
 	    std::atomic_flag flag;
 	    char written;
-	    char padding[256 - sizeof(std::atomic_flag) - sizeof(char) - sizeof(NanoLogLine)];
+	    char constructed;
+	    char padding[slot_size - sizeof(std::atomic_flag) - 2 * sizeof(char) - sizeof(uint32_t) - sizeof(NanoLogLine)];
+	    uint32_t sequence;
 	    NanoLogLine logline;
     	};
 	
-    	RingBuffer(size_t const size) 
+	/* Slots are constructed on first use, prefault puts every page in place up front instead */
+	RingBuffer(size_t const size, std::string const & crash_journal, bool prefault) 
     	    : m_size(size)
-    	    , m_ring(static_cast<Item*>(std::malloc(size * sizeof(Item))))
+	    , m_journal(crash_journal.empty() ? nullptr : new CrashJournal(crash_journal, sizeof(Item), size))
+	    , m_ring(static_cast<Item*>(m_journal ? m_journal->items() : std::calloc(size, sizeof(Item))))
     	    , m_write_index(0)
     	    , m_read_index(0)
     	{
-    	    for (size_t i = 0; i < m_size; ++i)
-    	    {
-    		new (&m_ring[i]) Item();
-    	    }
-	    static_assert(sizeof(Item) == 256, "Unexpected size != 256");
+	    static_assert(sizeof(Item) == slot_size, "Unexpected size != slot_size");
+	    if (prefault)
+		touch_pages(m_ring, size * sizeof(Item));
     	}
 
     	~RingBuffer()
     	{
     	    for (size_t i = 0; i < m_size; ++i)
     	    {
-    		m_ring[i].~Item();
+		if (m_ring[i].constructed)
+		    m_ring[i].logline.~NanoLogLine();
     	    }
-    	    std::free(m_ring);
+	    if (!m_journal)
+		std::free(m_ring);
     	}
 
+	BufferKind kind() const override
+	{
+	    return BufferKind::RING;
+	}
+
     	void push(NanoLogLine && logline) override
     	{
-    	    unsigned int write_index = m_write_index.fetch_add(1, std::memory_order_relaxed) % m_size;
-    	    Item & item = m_ring[write_index];
+	    unsigned int sequence = m_write_index.fetch_add(1, std::memory_order_relaxed);
+	    Item & item = m_ring[sequence % m_size];
     	    SpinLock spinlock(item.flag);
-	    item.logline = std::move(logline);
+	    if (item.written == 1)
+		increment(producer_counters().dropped);
+	    if (item.constructed)
+		item.logline = std::move(logline);
+	    else
+	    {
+		new (&item.logline) NanoLogLine(std::move(logline));
+		item.constructed = 1;
+	    }
+	    item.sequence = sequence;
 	    item.written = 1;
     	}
 
+	/*
+	 * Lines come out in push order. m_read_index is the sequence of the next line expected,
+	 * everything before it was written or overwritten.
+	 */
     	bool try_pop(NanoLogLine & logline) override
     	{
-    	    Item & item = m_ring[m_read_index % m_size];
-    	    SpinLock spinlock(item.flag);
-    	    if (item.written == 1)
-    	    {
-    		logline = std::move(item.logline);
-    		item.written = 0;
-		++m_read_index;
-    		return true;
-    	    }
-    	    return false;
+	    while (true)
+	    {
+		Item & item = m_ring[m_read_index % m_size];
+		SpinLock spinlock(item.flag);
+		if (item.written != 1)
+		    return false;
+		int32_t const ahead = static_cast < int32_t >(item.sequence - m_read_index);
+		if (ahead > 0)
+		{
+		    // Lapped, lines older than the last m_size claimed are overwritten or about to be.
+		    m_read_index = m_write_index.load(std::memory_order_acquire) - static_cast < unsigned int >(m_size);
+		    continue;
+		}
+		logline = std::move(item.logline);
+		// With a journal the slot keeps its bytes until the line reaches the file.
+		item.written = m_journal ? 2 : 0;
+		// Behind is a line which was claimed before a lap but pushed after it. Written, not waited for.
+		if (ahead == 0)
+		    ++m_read_index;
+		return true;
+	    }
     	}
 
+	void on_flush() override
+	{
+	    if (!m_journal)
+		return;
+
+	    // After a lap only the last m_size slots can hold lines popped since.
+	    if (m_read_index - m_flushed_index > m_size)
+		m_flushed_index = m_read_index - static_cast < unsigned int >(m_size);
+	    for (; m_flushed_index != m_read_index; ++m_flushed_index)
+	    {
+		Item & item = m_ring[m_flushed_index % m_size];
+		SpinLock spinlock(item.flag);
+		if (item.written == 2)
+		    item.written = 0;
+	    }
+	}
+
+	uint32_t claimed() override
+	{
+	    return m_write_index.load(std::memory_order_acquire);
+	}
+
+	uint32_t consumed() const override
+	{
+	    return m_read_index;
+	}
+
+	uint32_t capacity() const override
+	{
+	    return m_size;
+	}
+
+	/* SharedMemoryLogger - one past the last line the collector has written, journal backed rings only */
+	uint32_t collected()
+	{
+	    return m_journal->header()->flushed.load(std::memory_order_acquire);
+	}
+
     	RingBuffer(RingBuffer const &) = delete;	
     	RingBuffer& operator=(RingBuffer const &) = delete;
 
     private:
     	size_t const m_size;
+	std::unique_ptr < CrashJournal > m_journal;
     	Item * m_ring;
     	std::atomic < unsigned int > m_write_index;
 	char pad[64];
     	unsigned int m_read_index;
+	unsigned int m_flushed_index = 0;
     };
 
 
-    class Buffer
+    /*
+     * Text of string literals read from object files, by file and offset. Entries are kept
+     * until destruction, so the pointers handed out stay valid. A rebuilt file is a new file.
+     */
+    class LiteralTable
     {
     public:
-    	struct Item
-    	{
-	    Item(NanoLogLine && nanologline) : logline(std::move(nanologline)) {}
-	    char padding[256 - sizeof(NanoLogLine)];
-	    NanoLogLine logline;
-    	};
-
-	static constexpr const size_t size = 32768; // 8MB. Helps reduce memory fragmentation
-
-    	Buffer() : m_buffer(static_cast<Item*>(std::malloc(size * sizeof(Item))))
-    	{
-    	    for (size_t i = 0; i <= size; ++i)
-    	    {
-    		m_write_state[i].store(0, std::memory_order_relaxed);
-    	    }
-	    static_assert(sizeof(Item) == 256, "Unexpected size != 256");
-    	}
+	char const * read(std::string const & path, uint64_t offset)
+	{
+	    File & file = open(path);
+	    auto it = file.literals.find(offset);
+	    if (it == file.literals.end())
+	    {
+		std::string literal;
+		file.stream.clear();
+		file.stream.seekg(offset);
+		std::getline(file.stream, literal, '\0');
+		it = file.literals.emplace(offset, std::move(literal)).first;
+	    }
+	    return it->second.c_str();
+	}
 
-    	~Buffer()
-    	{
-	    unsigned int write_count = m_write_state[size].load();
-    	    for (size_t i = 0; i < write_count; ++i)
-    	    {
-    		m_buffer[i].~Item();
-    	    }
-    	    std::free(m_buffer);
-    	}
+	char const * unresolved(uint64_t address)
+	{
+	    auto it = m_unresolved.find(address);
+	    if (it == m_unresolved.end())
+	    {
+		char text[32];
+		snprintf(text, sizeof(text), "<%#llx>", static_cast < unsigned long long >(address));
+		it = m_unresolved.emplace(address, text).first;
+	    }
+	    return it->second.c_str();
+	}
 
-	// Returns true if we need to switch to next buffer
-    	bool push(NanoLogLine && logline, unsigned int const write_index)
-    	{
-	    new (&m_buffer[write_index]) Item(std::move(logline));
-	    m_write_state[write_index].store(1, std::memory_order_release);
-	    return m_write_state[size].fetch_add(1, std::memory_order_acquire) + 1 == size;
-    	}
+    private:
+	struct File
+	{
+	    std::ifstream stream;
+	    std::map < uint64_t, std::string > literals;
+	};
 
-    	bool try_pop(NanoLogLine & logline, unsigned int const read_index)
-    	{
-	    if (m_write_state[read_index].load(std::memory_order_acquire))
+	File & open(std::string const & path)
+	{
+	    struct stat st;
+	    std::string key = path;
+	    if (::stat(path.c_str(), &st) == 0)
+		key += ":" + std::to_string(st.st_ino) + ":" + std::to_string(st.st_mtime);
+	    std::unique_ptr < File > & file = m_files[key];
+	    if (!file)
 	    {
-		Item & item = m_buffer[read_index];
-		logline = std::move(item.logline);
-		return true;
+		file.reset(new File);
+		file->stream.open(path, std::ifstream::binary);
 	    }
-	    return false;
-    	}
-
-    	Buffer(Buffer const &) = delete;	
-    	Buffer& operator=(Buffer const &) = delete;
+	    return *file;
+	}
 
-    private:
-    	Item * m_buffer;
-	std::atomic < unsigned int > m_write_state[size + 1];
+	std::map < std::string, std::unique_ptr < File > > m_files;
+	std::map < uint64_t, std::string > m_unresolved;
     };
 
-    class QueueBuffer : public BufferBase
+    /* Resolves string literal pointers of another process, live or dead, by reading them from its object files */
+    class LiteralResolver
     {
     public:
-	QueueBuffer(QueueBuffer const &) = delete;
-	QueueBuffer& operator=(QueueBuffer const &) = delete;
+	LiteralResolver(JournalHeader const & header, LiteralTable & literals) : m_header(header), m_literals(literals)
+	{
+	}
 
-	QueueBuffer() : m_current_read_buffer{nullptr}
-				, m_write_index(0)
-			  , m_flag{ATOMIC_FLAG_INIT}
-		      , m_read_index(0)
+	char const * resolve(char const * literal)
 	{
-	    setup_next_write_buffer();
+	    uint64_t const address = reinterpret_cast < uint64_t >(literal);
+	    auto it = m_resolved.find(address);
+	    if (it == m_resolved.end())
+		it = m_resolved.emplace(address, read(address)).first;
+	    return it->second;
 	}
 
-    	void push(NanoLogLine && logline) override
-    	{
-    	    unsigned int write_index = m_write_index.fetch_add(1, std::memory_order_relaxed);
-	    if (write_index < Buffer::size)
+    private:
+	char const * read(uint64_t address)
+	{
+	    for (size_t m = 0; m < m_header.module_count && m < JournalHeader::max_modules; ++m)
 	    {
-		if (m_current_write_buffer.load(std::memory_order_acquire)->push(std::move(logline), write_index))
+		JournalModule const & module = m_header.modules[m];
+		for (size_t i = 0; i < module.segment_count && i < 8; ++i)
 		{
-		    setup_next_write_buffer();
+		    JournalSegment const & segment = module.segments[i];
+		    uint64_t const begin = module.bias + segment.vaddr;
+		    if (address < begin || address >= begin + segment.filesz)
+			continue;
+		    std::string const path(module.path, strnlen(module.path, sizeof(module.path)));
+		    return m_literals.read(path, segment.offset + (address - begin));
 		}
 	    }
-	    else
+	    return m_literals.unresolved(address);
+	}
+
+    private:
+	JournalHeader const & m_header;
+	LiteralTable & m_literals;
+	std::unordered_map < uint64_t, char const * > m_resolved;
+    };
+
+    /* The ring of a SharedMemoryLogger process, mapped by the collector */
+    class CollectedQueue
+    {
+    public:
+	/* nullptr if the file cannot be mapped */
+	static CollectedQueue * map(std::string const & path, LiteralTable & literals)
+	{
+	    int const fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+	    if (fd == -1)
+		return nullptr;
+	    struct stat st;
+	    void * memory = MAP_FAILED;
+	    if (::fstat(fd, &st) == 0 && static_cast < size_t >(st.st_size) >= JournalHeader::items_offset)
+		memory = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	    if (memory == MAP_FAILED)
 	    {
-		while (m_write_index.load(std::memory_order_acquire) >= Buffer::size);
-		push(std::move(logline));
+		::close(fd);
+		return nullptr;
 	    }
-    	}
+	    return new CollectedQueue(path, fd, st, static_cast < char * >(memory), literals);
+	}
 
-    	bool try_pop(NanoLogLine & logline) override
+	~CollectedQueue()
 	{
-	    if (m_current_read_buffer == nullptr)
-		m_current_read_buffer = get_next_read_buffer();
+	    ::munmap(m_memory, m_size);
+	    ::close(m_fd);
+	}
 
-	    Buffer * read_buffer = m_current_read_buffer;
+	/* False while the producer is still setting the queue up */
+	bool ready() const
+	{
+	    bool const ready = memcmp(m_header->magic, journal_magic, sizeof(journal_magic)) == 0;
+	    std::atomic_thread_fence(std::memory_order_acquire);
+	    return ready;
+	}
 
-	    if (read_buffer == nullptr)
+	bool compatible() const
+	{
+	    return m_header->version == JournalHeader::current_version && m_header->item_size == sizeof(RingBuffer::Item)
+		&& m_size >= JournalHeader::items_offset + m_header->slots * m_header->item_size;
+	}
+
+	bool is(struct stat const & st) const
+	{
+	    return st.st_dev == m_dev && st.st_ino == m_ino;
+	}
+
+	/* In push order, as RingBuffer::try_pop() */
+	bool pop(NanoLogLine & logline)
+	{
+	    RingBuffer::Item & item = items()[m_read_index % m_header->slots];
+	    // Never spin, the producer may have died holding the flag.
+	    if (item.flag.test_and_set(std::memory_order_acquire))
+		return false;
+	    bool const written = item.written == 1;
+	    int32_t const ahead = static_cast < int32_t >(item.sequence - m_read_index);
+	    uint32_t const lapped_by = item.sequence;
+	    bool complete = false;
+	    if (written && ahead <= 0)
+	    {
+		complete = RecordCodec::restore(logline, item.logline);
+		item.written = 0;
+		if (ahead == 0)
+		    ++m_read_index;
+	    }
+	    item.flag.clear(std::memory_order_release);
+	    if (written && ahead > 0)
+	    {
+		skip_lapped(lapped_by);
+		return pop(logline);
+	    }
+	    if (!written)
 		return false;
 
-	    if (bool success = read_buffer->try_pop(logline, m_read_index))
+	    RecordCodec::for_each_literal(logline, [this](char const * & literal) { literal = m_resolver.resolve(literal); });
+	    RecordCodec::forget_interned(logline);
+	    if (!complete)
+		logline << "<arguments were on the heap and are lost>";
+	    return true;
+	}
+
+	/* The producer may have gone round the ring before the collector attached, starts with its oldest line */
+	void seek_oldest()
+	{
+	    bool found = false;
+	    for (uint64_t i = 0; i < m_header->slots; ++i)
 	    {
-		m_read_index++;
-		if (m_read_index == Buffer::size)
+		RingBuffer::Item const & item = items()[i];
+		if (item.written == 1 && (!found || static_cast < int32_t >(item.sequence - m_read_index) < 0))
 		{
-		    m_read_index = 0;
-		    m_current_read_buffer = nullptr;
-		    SpinLock spinlock(m_flag);
-		    m_buffers.pop();
+		    m_read_index = item.sequence;
+		    found = true;
 		}
-		return true;
 	    }
+	}
+
+	/* The producer went round the ring past the read position, continues with its oldest line still there */
+	void skip_lapped(uint32_t lapped_by)
+	{
+	    uint32_t oldest = lapped_by;
+	    for (uint64_t i = 0; i < m_header->slots; ++i)
+	    {
+		RingBuffer::Item const & item = items()[i];
+		if (item.written == 1 && static_cast < int32_t >(item.sequence - m_read_index) > 0 && static_cast < int32_t >(item.sequence - oldest) < 0)
+		    oldest = item.sequence;
+	    }
+	    m_read_index = oldest;
+	}
 
+	/* As pop(), once nobody pushes any more. Skips slots which were claimed but never written. */
+	bool pop_remaining(NanoLogLine & logline)
+	{
+	    for (uint64_t i = 0; i < m_header->slots; ++i, ++m_read_index)
+	    {
+		if (pop(logline))
+		    return true;
+	    }
 	    return false;
 	}
 
-    private:
-	void setup_next_write_buffer()
+	/* Every line pushed before it was popped or overwritten */
+	uint32_t consumed() const
 	{
-	    std::unique_ptr < Buffer > next_write_buffer(new Buffer());
-	    m_current_write_buffer.store(next_write_buffer.get(), std::memory_order_release);
-	    SpinLock spinlock(m_flag);
-	    m_buffers.push(std::move(next_write_buffer));
-	    m_write_index.store(0, std::memory_order_relaxed);
+	    return m_read_index;
+	}
+
+	/* Lets producers waiting in flush() know the lines up to written are in the log file */
+	void publish(uint32_t written)
+	{
+	    m_header->flushed.store(written, std::memory_order_release);
+	}
+
+	/* The producer removed the queue on exit, or died */
+	bool abandoned() const
+	{
+	    struct stat st;
+	    if (::fstat(m_fd, &st) == 0 && st.st_nlink == 0)
+		return true;
+	    return ::kill(static_cast < pid_t >(m_header->pid), 0) == -1 && errno == ESRCH;
+	}
+
+	/* Deletes the file left behind by a producer which died */
+	void remove() const
+	{
+	    struct stat st;
+	    if (::stat(m_path.c_str(), &st) == 0 && is(st))
+		::unlink(m_path.c_str());
+	}
+
+	std::string const & path() const
+	{
+	    return m_path;
+	}
+
+	uint64_t pid() const
+	{
+	    return m_header->pid;
+	}
+
+	CollectedQueue(CollectedQueue const &) = delete;
+	CollectedQueue& operator=(CollectedQueue const &) = delete;
+
+    private:
+	CollectedQueue(std::string const & path, int fd, struct stat const & st, char * memory, LiteralTable & literals)
+	    : m_path(path)
+	    , m_fd(fd)
+	    , m_dev(st.st_dev)
+	    , m_ino(st.st_ino)
+	    , m_size(static_cast < size_t >(st.st_size))
+	    , m_memory(memory)
+	    , m_header(reinterpret_cast < JournalHeader * >(memory))
+	    , m_resolver(*m_header, literals)
+	{
+	}
+
+	RingBuffer::Item * items()
+	{
+	    return reinterpret_cast < RingBuffer::Item * >(m_memory + JournalHeader::items_offset);
+	}
+
+	std::string const m_path;
+	int const m_fd;
+	dev_t const m_dev;
+	ino_t const m_ino;
+	size_t const m_size;
+	char * m_memory;
+	JournalHeader * m_header;
+	LiteralResolver m_resolver;
+	uint32_t m_read_index = 0;
+    };
+
+    /*
+     * The buffer of nanolog_collector. Merges, oldest first, the lines of every SharedMemoryLogger
+     * queue in the queue directory with the lines logged by the collector itself. The directory is
+     * scanned for new queues every 200ms, queues are dropped once their producer is gone and
+     * they are drained.
+     */
+    class CollectorBuffer : public BufferBase
+    {
+    public:
+	CollectorBuffer(std::string const & queue_directory)
+	    : m_directory(queue_directory)
+	    , m_local(4096, std::string(), false)
+	{
+	    ::mkdir(queue_directory.c_str(), 0755);
+	    m_sources.emplace_back(nullptr);
+	}
+
+	void push(NanoLogLine && logline) override
+	{
+	    m_local.push(std::move(logline));
+	}
+
+	bool try_pop(NanoLogLine & logline) override
+	{
+	    if ((++m_pops & 4095) == 0)
+		scan_if_due();
+
+	    Source * oldest = nullptr;
+	    for (Source & source : m_sources)
+	    {
+		if (!source.ready)
+		    source.ready = pop(source);
+		if (source.ready && (oldest == nullptr || source.head.timestamp() < oldest->head.timestamp()))
+		    oldest = &source;
+	    }
+	    if (oldest == nullptr)
+		return false;
+
+	    logline = std::move(oldest->head);
+	    oldest->ready = false;
+	    oldest->written = oldest->popped;
+	    return true;
+	}
+
+	void on_flush() override
+	{
+	    for (Source & source : m_sources)
+	    {
+		if (source.queue)
+		    source.queue->publish(source.written);
+	    }
+	}
+
+	void reserve() override
+	{
+	    scan_if_due();
+	}
+
+	uint32_t claimed() override
+	{
+	    return m_local.claimed();
+	}
+
+	uint32_t consumed() const override
+	{
+	    return m_sources.front().written;
+	}
+
+    private:
+	struct Source
+	{
+	    Source(CollectedQueue * queue_) : queue(queue_), head(LogLevel::INFO, nullptr, nullptr, 0) {}
+
+	    std::unique_ptr < CollectedQueue > queue;	// nullptr for the lines of the collector itself
+	    NanoLogLine head;
+	    bool ready = false;				// head is the next line of this source
+	    bool abandoned = false;
+	    bool drained = false;
+	    uint32_t popped = 0;			// consumed() after head was popped
+	    uint32_t written = 0;			// consumed() after the last line handed out
+	};
+
+	bool pop(Source & source)
+	{
+	    if (!source.queue)
+	    {
+		bool const popped = m_local.try_pop(source.head);
+		source.popped = m_local.consumed();
+		return popped;
+	    }
+	    if (source.drained)
+		return false;
+	    bool const popped = source.abandoned ? source.queue->pop_remaining(source.head) : source.queue->pop(source.head);
+	    source.drained = source.abandoned && !popped;
+	    source.popped = source.queue->consumed();
+	    return popped;
+	}
+
+	void scan_if_due()
+	{
+	    auto const now = std::chrono::steady_clock::now();
+	    if (now < m_next_scan)
+		return;
+	    m_next_scan = now + std::chrono::milliseconds(200);
+	    detach();
+	    attach();
+	}
+
+	void detach()
+	{
+	    for (auto it = m_sources.begin(); it != m_sources.end(); )
+	    {
+		if (it->queue && it->drained)
+		{
+		    LOG_INFO << "Detached " << it->queue->path() << " of process " << it->queue->pid();
+		    it->queue->remove();
+		    it = m_sources.erase(it);
+		    continue;
+		}
+		// Drained with pop_remaining() from now on
+		if (it->queue && !it->abandoned)
+		    it->abandoned = it->queue->abandoned();
+		++it;
+	    }
+	}
+
+	void attach()
+	{
+	    DIR * directory = ::opendir(m_directory.c_str());
+	    if (directory == nullptr)
+		return;
+	    while (dirent * entry = ::readdir(directory))
+	    {
+		std::string const name(entry->d_name);
+		if (name.size() <= 6 || name.compare(name.size() - 6, 6, ".queue") != 0)
+		    continue;
+		std::string const path = m_directory + "/" + name;
+		struct stat st;
+		if (::stat(path.c_str(), &st) != 0 || known(st))
+		    continue;
+		std::unique_ptr < CollectedQueue > queue(CollectedQueue::map(path, m_literals));
+		if (!queue || !queue->ready())
+		    continue;	// Try again with the next scan
+		if (!queue->compatible())
+		{
+		    m_ignored.insert(std::make_pair(st.st_dev, st.st_ino));
+		    LOG_WARN << "Ignoring " << path << ", written by an incompatible NanoLog build";
+		    continue;
+		}
+		LOG_INFO << "Attached " << path << " of process " << queue->pid();
+		queue->seek_oldest();
+		m_sources.emplace_back(queue.release());
+	    }
+	    ::closedir(directory);
+	}
+
+	bool known(struct stat const & st) const
+	{
+	    for (Source const & source : m_sources)
+	    {
+		if (source.queue && source.queue->is(st))
+		    return true;
+	    }
+	    return m_ignored.count(std::make_pair(st.st_dev, st.st_ino)) != 0;
+	}
+
+	std::string const m_directory;
+	RingBuffer m_local;
+	LiteralTable m_literals;
+	std::vector < Source > m_sources;		// The collector's own lines first
+	std::set < std::pair < dev_t, ino_t > > m_ignored;
+	std::chrono::steady_clock::time_point m_next_scan;
+	uint32_t m_pops = 0;
+    };
+
+    class Buffer
+    {
+    public:
+    	struct Item
+    	{
+	    Item(NanoLogLine && nanologline) : logline(std::move(nanologline)) {}
+	    char padding[slot_size - sizeof(NanoLogLine)];
+	    NanoLogLine logline;
+    	};
+
+	static constexpr const size_t size = 8 * 1024 * 1024 / slot_size; // 8MB. Helps reduce memory fragmentation
+
+	/* Write states come zeroed from calloc, so their pages are only touched as lines are pushed */
+	Buffer() : m_base(0)
+		 , m_buffer(static_cast<Item*>(std::malloc(size * sizeof(Item))))
+		 , m_write_state(static_cast < std::atomic < unsigned int > * >(std::calloc(size + 1, sizeof(std::atomic < unsigned int >))))
+    	{
+	    static_assert(sizeof(Item) == slot_size, "Unexpected size != slot_size");
+    	}
+
+    	~Buffer()
+    	{
+	    unsigned int write_count = m_write_state[size].load();
+    	    for (size_t i = 0; i < write_count; ++i)
+    	    {
+    		m_buffer[i].~Item();
+    	    }
+    	    std::free(m_buffer);
+	    std::free(m_write_state);
+    	}
+
+	// Returns true if we need to switch to next buffer
+    	bool push(NanoLogLine && logline, unsigned int const write_index)
+    	{
+	    new (&m_buffer[write_index]) Item(std::move(logline));
+	    m_write_state[write_index].store(1, std::memory_order_release);
+	    return m_write_state[size].fetch_add(1, std::memory_order_acquire) + 1 == size;
+    	}
+
+    	bool try_pop(NanoLogLine & logline, unsigned int const read_index)
+    	{
+	    if (m_write_state[read_index].load(std::memory_order_acquire))
+	    {
+		Item & item = m_buffer[read_index];
+		logline = std::move(item.logline);
+		return true;
+	    }
+	    return false;
+    	}
+
+	/* Flush barrier sequence number of the first slot */
+	uint32_t base() const
+	{
+	    return m_base;
+	}
+
+	void set_base(uint32_t base)
+	{
+	    m_base = base;
+	}
+
+	/* Touches every page, so they get placed on the NUMA node of the calling thread */
+	void prefault()
+	{
+	    touch_pages(m_buffer, size * sizeof(Item));
+	}
+
+    	Buffer(Buffer const &) = delete;	
+    	Buffer& operator=(Buffer const &) = delete;
+
+    private:
+	uint32_t m_base;
+    	Item * m_buffer;
+	std::atomic < unsigned int > * m_write_state;
+    };
+
+    class QueueBuffer final : public BufferBase
+    {
+    public:
+	QueueBuffer(QueueBuffer const &) = delete;
+	QueueBuffer& operator=(QueueBuffer const &) = delete;
+
+	/*
+	 * allocate_on_consumer - the consumer thread keeps a prefaulted spare buffer for
+	 * producers to switch to, so buffers live on the consumer's NUMA node.
+	 */
+	QueueBuffer(bool allocate_on_consumer) : m_current_read_buffer{nullptr}
+				, m_write_index(0)
+			  , m_flag{ATOMIC_FLAG_INIT}
+		      , m_read_index(0)
+		      , m_allocate_on_consumer(allocate_on_consumer)
+		      , m_spare_buffer(nullptr)
+	{
+	    reserve();
+	    setup_next_write_buffer();
+	    reserve();
+	}
+
+	~QueueBuffer()
+	{
+	    delete m_spare_buffer.load();
+	}
+
+	BufferKind kind() const override
+	{
+	    return BufferKind::QUEUE;
+	}
+
+    	void push(NanoLogLine && logline) override
+    	{
+    	    unsigned int write_index = m_write_index.fetch_add(1, std::memory_order_relaxed);
+	    if (write_index < Buffer::size)
+	    {
+		if (m_current_write_buffer.load(std::memory_order_acquire)->push(std::move(logline), write_index))
+		{
+		    setup_next_write_buffer();
+		}
+	    }
+	    else
+	    {
+		while (m_write_index.load(std::memory_order_acquire) >= Buffer::size);
+		push(std::move(logline));
+	    }
+    	}
+
+    	bool try_pop(NanoLogLine & logline) override
+	{
+	    if (m_current_read_buffer == nullptr)
+		m_current_read_buffer = get_next_read_buffer();
+
+	    Buffer * read_buffer = m_current_read_buffer;
+
+	    if (read_buffer == nullptr)
+		return false;
+
+	    if (bool success = read_buffer->try_pop(logline, m_read_index))
+	    {
+		m_consumed = read_buffer->base() + m_read_index + 1;
+		m_read_index++;
+		if (m_read_index == Buffer::size)
+		{
+		    m_read_index = 0;
+		    m_current_read_buffer = nullptr;
+		    SpinLock spinlock(m_flag);
+		    m_buffers.pop();
+		    metrics.buffer_count.store(m_buffers.size(), std::memory_order_relaxed);
+		    reserve();
+		}
+		return true;
+	    }
+
+	    return false;
+	}
+
+	uint32_t claimed() override
+	{
+	    // m_flag orders this against setup_next_write_buffer() swapping buffers.
+	    SpinLock spinlock(m_flag);
+	    unsigned int const write_index = m_write_index.load(std::memory_order_acquire);
+	    return m_current_write_buffer.load(std::memory_order_acquire)->base() + std::min(write_index, static_cast < unsigned int >(Buffer::size));
+	}
+
+	uint32_t consumed() const override
+	{
+	    return m_consumed;
+	}
+
+	/* One buffer, the queue allocates more beyond that */
+	uint32_t capacity() const override
+	{
+	    return Buffer::size;
+	}
+
+	void reserve() override
+	{
+	    if (!m_allocate_on_consumer || m_spare_buffer.load(std::memory_order_relaxed) != nullptr)
+		return;
+	    std::unique_ptr < Buffer > spare(new Buffer());
+	    spare->prefault();
+	    m_spare_buffer.store(spare.release(), std::memory_order_release);
+	}
+
+    private:
+	void setup_next_write_buffer()
+	{
+	    std::unique_ptr < Buffer > next_write_buffer(m_spare_buffer.exchange(nullptr, std::memory_order_acquire));
+	    if (!next_write_buffer)
+		next_write_buffer.reset(new Buffer());
+	    next_write_buffer->set_base(m_next_base);
+	    m_next_base += Buffer::size;
+	    SpinLock spinlock(m_flag);
+	    m_current_write_buffer.store(next_write_buffer.get(), std::memory_order_release);
+	    m_buffers.push(std::move(next_write_buffer));
+	    metrics.buffer_count.store(m_buffers.size(), std::memory_order_relaxed);
+	    update_max(metrics.buffer_high_water_mark, m_buffers.size());
+	    m_write_index.store(0, std::memory_order_relaxed);
 	}
 	
 	Buffer * get_next_read_buffer()
@@ -546,163 +2265,1450 @@ namespace nanolog
 	    return m_buffers.empty() ? nullptr : m_buffers.front().get();
 	}
 
-    private:
-	std::queue < std::unique_ptr < Buffer > > m_buffers;
-    	std::atomic < Buffer * > m_current_write_buffer;
-	Buffer * m_current_read_buffer;
-    	std::atomic < unsigned int > m_write_index;
-	std::atomic_flag m_flag;
-    	unsigned int m_read_index;
-    };
-
-    class FileWriter
-    {
-    public:
-	FileWriter(std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb)
-	    : m_log_file_roll_size_bytes(log_file_roll_size_mb * 1024 * 1024)
-	    , m_name(log_directory + log_file_name)
+    private:
+	std::queue < std::unique_ptr < Buffer > > m_buffers;
+    	std::atomic < Buffer * > m_current_write_buffer;
+	Buffer * m_current_read_buffer;
+    	std::atomic < unsigned int > m_write_index;
+	std::atomic_flag m_flag;
+    	unsigned int m_read_index;
+	uint32_t m_next_base = 0;   // Only touched by the producer which fills a buffer
+	uint32_t m_consumed = 0;
+	bool const m_allocate_on_consumer;
+	std::atomic < Buffer * > m_spare_buffer;
+    };
+
+    /*
+     * Sidecar index of a log file, <name>.<n>.idx - an IndexHeader, then one IndexEntry per
+     * block of about block_bytes of complete lines, appended as blocks fill up.
+     * Lines past the last entry are not indexed yet.
+     */
+    struct IndexHeader
+    {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_bytes;
+    };
+
+    struct IndexEntry
+    {
+	static constexpr const size_t levels = 3;
+
+	uint64_t offset;
+	uint64_t bytes;
+	uint64_t min_timestamp;
+	uint64_t max_timestamp;
+	uint32_t lines;
+	uint32_t level_counts[levels];	// Indexed by LogLevel
+    };
+
+    char const index_magic[8] = { 'N', 'A', 'N', 'O', 'I', 'D', 'X', '1' };
+
+    /* foo.3.txt -> foo.3.idx */
+    std::string index_path(std::string const & log_path)
+    {
+	size_t const extension = log_path.size() >= 4 && log_path.compare(log_path.size() - 4, 4, ".txt") == 0 ? log_path.size() - 4 : log_path.size();
+	return log_path.substr(0, extension) + ".idx";
+    }
+
+    class FileWriter
+    {
+    public:
+	FileWriter(std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb, FileRolling const & file_rolling, bool flush_each_line)
+	    : m_log_file_roll_size_bytes(log_file_roll_size_mb * 1024 * 1024)
+	    , m_name(log_directory + log_file_name)
+	    , m_file_rolling(file_rolling)
+	    , m_flush_each_line(flush_each_line)
+	{
+	    start_series();
+	}
+
+	~FileWriter()
+	{
+	    finish_block();
+	    discard_next_file();
+	}
+	
+	void write(NanoLogLine & logline)
+	{
+	    if (logline.timestamp() >= m_roll_at_us)
+	    {
+		roll_file();
+	    }
+	    auto const begin = std::chrono::steady_clock::now();
+	    auto pos = m_os->tellp();
+	    logline.stringify(*m_os);
+	    std::streamoff const bytes = m_os->tellp() - pos;
+	    if (m_index)
+		index_line(logline, m_bytes_written, bytes);
+	    m_bytes_written += bytes;
+	    auto const elapsed = std::chrono::duration_cast < std::chrono::nanoseconds >(std::chrono::steady_clock::now() - begin).count();
+	    record_write(logline.timestamp(), bytes, elapsed);
+	    if (m_bytes_written > m_log_file_roll_size_bytes)
+	    {
+		roll_file();
+	    }
+	    else if (m_flush_each_line)
+	    {
+		m_os->flush();
+	    }
+	}
+
+	void flush()
+	{
+	    m_os->flush();
+	}
+
+	/* A new directory or file name starts a new series of files, otherwise the current file carries on */
+	void reconfigure(std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb, FileRolling const & file_rolling)
+	{
+	    m_log_file_roll_size_bytes = log_file_roll_size_mb * 1024 * 1024;
+	    m_file_rolling = file_rolling;
+	    m_roll_at_us = next_roll_at(timestamp_now());
+	    if (m_name == log_directory + log_file_name)
+		return;
+	    m_os->flush();
+	    close_file();
+	    discard_next_file();
+	    m_name = log_directory + log_file_name;
+	    m_file_number = 0;
+	    start_series();
+	}
+
+	void set_flush_each_line(bool flush_each_line)
+	{
+	    m_flush_each_line = flush_each_line;
+	}
+
+	/* Flushes and fsyncs the current file and every file rolled since the last sync */
+	void sync()
+	{
+	    m_os->flush();
+	    m_unsynced_files.push_back(m_file_path);
+	    for (std::string const & path : m_unsynced_files)
+	    {
+		int const fd = ::open(path.c_str(), O_RDONLY);
+		if (fd == -1)
+		    continue;
+		::fsync(fd);
+		::close(fd);
+	    }
+	    m_unsynced_files.clear();
+	}
+
+    private:
+	static void record_write(uint64_t timestamp, std::streamoff bytes, int64_t elapsed_ns)
+	{
+	    uint64_t const now = timestamp_now();
+	    uint64_t const lag = now > timestamp ? now - timestamp : 0;
+	    metrics.consumer_lag_us.store(lag, std::memory_order_relaxed);
+	    update_max(metrics.max_consumer_lag_us, lag);
+	    increment(metrics.lines_written);
+	    increment(metrics.bytes_written, static_cast < uint64_t >(bytes));
+
+	    size_t bucket = 0;
+	    for (uint64_t ns = static_cast < uint64_t >(elapsed_ns) >> 1; ns != 0 && bucket + 1 < Stats::write_latency_buckets; ns >>= 1)
+		++bucket;
+	    increment(metrics.write_latency_ns[bucket]);
+	}
+
+	std::string file_path(uint32_t file_number) const
+	{
+	    // TODO Optimize this part. Does it even matter ?
+	    std::string log_file_name = m_name;
+	    log_file_name.append(".");
+	    log_file_name.append(std::to_string(file_number));
+	    log_file_name.append(".txt");
+	    return log_file_name;
+	}
+
+	/* Microseconds since epoch of the next hour / day boundary (UTC) after now, never if not rolling by time */
+	uint64_t next_roll_at(uint64_t now) const
+	{
+	    uint64_t const hour = 3600ull * 1000000;
+	    switch (m_file_rolling.interval)
+	    {
+	    case RollInterval::HOURLY:
+		return (now / hour + 1) * hour;
+	    case RollInterval::DAILY:
+		return (now / (24 * hour) + 1) * (24 * hour);
+	    case RollInterval::NONE:
+		break;
+	    }
+	    return std::numeric_limits < uint64_t >::max();
+	}
+
+	/* A log file and its index, if there is one */
+	struct OpenFile
+	{
+	    std::unique_ptr < std::ofstream > log;
+	    std::unique_ptr < std::ofstream > index;
+	    uint32_t index_block_bytes;
+	};
+
+	/*
+	 * Opens path on a helper thread, so rolling never waits for the file system.
+	 * Closing the previous file and deleting files past retention happens there too.
+	 */
+	static OpenFile open_file(std::string const & path, uint32_t index_block_bytes, OpenFile previous, std::vector < std::string > const & expired)
+	{
+	    previous.log.reset();
+	    previous.index.reset();
+	    for (std::string const & file : expired)
+	    {
+		::unlink(file.c_str());
+		::unlink(index_path(file).c_str());
+	    }
+	    OpenFile file;
+	    file.log.reset(new std::ofstream());
+	    file.log->open(path, std::ofstream::out | std::ofstream::trunc);
+	    file.index_block_bytes = index_block_bytes;
+	    if (index_block_bytes != 0)
+	    {
+		file.index.reset(new std::ofstream(index_path(path), std::ofstream::out | std::ofstream::trunc | std::ofstream::binary));
+		IndexHeader header = {};
+		memcpy(header.magic, index_magic, sizeof(index_magic));
+		header.version = 1;
+		header.block_bytes = index_block_bytes;
+		file.index->write(reinterpret_cast < char const * >(&header), sizeof(header));
+	    }
+	    return file;
+	}
+
+	void prepare_next_file(OpenFile previous, std::vector < std::string > expired)
+	{
+	    m_next_file = std::async(std::launch::async, &FileWriter::open_file, file_path(m_file_number + 1), m_file_rolling.index_block_kb * 1024, std::move(previous), std::move(expired));
+	}
+
+	void use(OpenFile file)
+	{
+	    m_os = std::move(file.log);
+	    m_index = std::move(file.index);
+	    m_index_block_bytes = file.index_block_bytes;
+	    m_block = IndexEntry();
+	    m_file_path = file_path(m_file_number);
+	    m_bytes_written = 0;
+	    m_roll_at_us = next_roll_at(timestamp_now());
+	}
+
+	/* The first file is opened right away, the one after it in the background */
+	void start_series()
+	{
+	    ++m_file_number;
+	    use(open_file(file_path(m_file_number), m_file_rolling.index_block_kb * 1024, OpenFile(), std::vector < std::string >()));
+	    prepare_next_file(OpenFile(), std::vector < std::string >());
+	}
+
+	/* Removes the file opened ahead of time, it was never written to */
+	void discard_next_file()
+	{
+	    if (!m_next_file.valid())
+		return;
+	    m_next_file.get();
+	    ::unlink(file_path(m_file_number + 1).c_str());
+	    ::unlink(index_path(file_path(m_file_number + 1)).c_str());
+	}
+
+	void index_line(NanoLogLine & logline, uint64_t offset, uint64_t bytes)
+	{
+	    uint64_t const timestamp = logline.timestamp();
+	    if (m_block.lines == 0)
+	    {
+		m_block.offset = offset;
+		m_block.min_timestamp = m_block.max_timestamp = timestamp;
+	    }
+	    m_block.min_timestamp = std::min(m_block.min_timestamp, timestamp);
+	    m_block.max_timestamp = std::max(m_block.max_timestamp, timestamp);
+	    m_block.bytes += bytes;
+	    ++m_block.lines;
+	    size_t const level = static_cast < size_t >(logline.level());
+	    if (level < IndexEntry::levels)
+		++m_block.level_counts[level];
+	    if (m_block.bytes >= m_index_block_bytes)
+		finish_block();
+	}
+
+	/* Appends the entry of the current block to the index. One small write per block. */
+	void finish_block()
+	{
+	    if (!m_index || m_block.lines == 0)
+		return;
+	    m_index->write(reinterpret_cast < char const * >(&m_block), sizeof(m_block));
+	    m_index->flush();
+	    m_block = IndexEntry();
+	}
+
+	/* Remembers the current file for sync() and retention */
+	void close_file()
+	{
+	    finish_block();
+	    // Anything older has long been written back by the kernel.
+	    if (m_unsynced_files.size() == 1024)
+		m_unsynced_files.pop_front();
+	    m_unsynced_files.push_back(m_file_path);
+	    m_closed_files.push_back(std::make_pair(m_file_path, static_cast < uint64_t >(m_bytes_written)));
+	    m_closed_bytes += m_bytes_written;
+	}
+
+	/* Oldest files beyond max_files / max_total_bytes, the current file counts towards both */
+	std::vector < std::string > expired_files()
+	{
+	    std::vector < std::string > expired;
+	    auto too_many = [this]()
+	    {
+		return (m_file_rolling.max_files != 0 && m_closed_files.size() + 1 > m_file_rolling.max_files)
+		    || (m_file_rolling.max_total_bytes != 0 && m_closed_bytes + m_bytes_written > m_file_rolling.max_total_bytes);
+	    };
+	    while (!m_closed_files.empty() && too_many())
+	    {
+		expired.push_back(m_closed_files.front().first);
+		m_closed_bytes -= m_closed_files.front().second;
+		m_closed_files.pop_front();
+	    }
+	    return expired;
+	}
+
+	void roll_file()
+	{
+	    m_os->flush();
+	    close_file();
+	    increment(metrics.roll_count);
+
+	    OpenFile previous;
+	    previous.log = std::move(m_os);
+	    previous.index = std::move(m_index);
+	    ++m_file_number;
+	    use(m_next_file.get());
+	    prepare_next_file(std::move(previous), expired_files());
+	}
+
+    private:
+	uint32_t m_file_number = 0;
+	std::streamoff m_bytes_written = 0;
+	uint32_t m_log_file_roll_size_bytes;
+	std::string m_name;
+	FileRolling m_file_rolling;
+	uint64_t m_roll_at_us;
+	bool m_flush_each_line;
+	std::string m_file_path;
+	std::deque < std::string > m_unsynced_files;
+	std::deque < std::pair < std::string, uint64_t > > m_closed_files;
+	uint64_t m_closed_bytes = 0;
+	std::unique_ptr < std::ofstream > m_os;
+	std::unique_ptr < std::ofstream > m_index;
+	uint32_t m_index_block_bytes = 0;
+	IndexEntry m_block = IndexEntry();
+	std::future < OpenFile > m_next_file;
+    };
+
+    /* The queue part of initialize() */
+    struct BufferSettings
+    {
+	std::function < BufferBase * () > make;
+	bool flush_each_line;	// Unless the lines are kept in a journal until they reach the file
+	uint32_t lines_per_checkpoint;	// Journal only - lines between flushes, so slots awaiting the file do not pile up
+    };
+
+    BufferSettings buffer_settings(NonGuaranteedLogger ngl, ConsumerThread const & consumer_thread)
+    {
+	uint32_t const ring_buffer_size_mb = std::max(1u, ngl.ring_buffer_size_mb);
+	std::string const crash_journal = ngl.crash_journal;
+	// make() runs on the pinned background thread then.
+	bool const allocate_on_consumer = consumer_thread.buffer_placement == BufferPlacement::CONSUMER;
+	BufferSettings settings;
+	settings.make = [ring_buffer_size_mb, crash_journal, allocate_on_consumer]() -> BufferBase *
+	    { return new RingBuffer(ring_buffer_size_mb * 1024 * 1024 / slot_size, crash_journal, allocate_on_consumer); };
+	settings.flush_each_line = crash_journal.empty();
+	// Twice per lap of the ring.
+	settings.lines_per_checkpoint = crash_journal.empty() ? 0 : ring_buffer_size_mb * 1024 * 1024 / slot_size / 2;
+	return settings;
+    }
+
+    BufferSettings buffer_settings(SharedMemoryCollector smc, ConsumerThread const &)
+    {
+	std::string const queue_directory = smc.queue_directory;
+	BufferSettings settings;
+	settings.make = [queue_directory]() -> BufferBase * { return new CollectorBuffer(queue_directory); };
+	// The queues are journals, lines stay there until the checkpoint after they were written.
+	settings.flush_each_line = false;
+	// Also lets producers waiting in flush() go while the collector is busy.
+	settings.lines_per_checkpoint = 16 * 1024;
+	return settings;
+    }
+
+    BufferSettings buffer_settings(GuaranteedLogger, ConsumerThread const & consumer_thread)
+    {
+	bool const allocate_on_consumer = consumer_thread.buffer_placement == BufferPlacement::CONSUMER;
+	BufferSettings settings;
+	settings.make = [allocate_on_consumer]() -> BufferBase * { return new QueueBuffer(allocate_on_consumer); };
+	settings.flush_each_line = true;
+	settings.lines_per_checkpoint = 0;
+	return settings;
+    }
+
+    /*
+     * Collapses runs of records from the same call site with the same level and encoded
+     * arguments, whichever thread logged them. Records are compared byte for byte before
+     * they are formatted. The first record of a run is written, the repeats are counted
+     * and summed up by one record when the run ends.
+     */
+    class DuplicateFilter
+    {
+    public:
+	/* Returns true if logline repeats the current run, which then counts it */
+	bool absorb(NanoLogLine & logline, uint64_t window_us)
+	{
+	    char const * record = RecordCodec::call_site(logline);
+	    size_t const bytes = RecordCodec::end(logline) - record;
+	    if (m_record.size() != bytes || logline.timestamp() - m_first_timestamp >= window_us || memcmp(m_record.data(), record, bytes) != 0)
+		return false;
+	    ++m_repeats;
+	    m_last_timestamp = logline.timestamp();
+	    m_thread_id = RecordCodec::thread_id(logline);
+	    return true;
+	}
+
+	/* Makes logline, which was just written, the first record of a new run */
+	void start(NanoLogLine & logline)
+	{
+	    char const * record = RecordCodec::call_site(logline);
+	    m_record.assign(record, static_cast < char const * >(RecordCodec::end(logline)));
+	    m_first_timestamp = m_last_timestamp = logline.timestamp();
+	    m_thread_id = RecordCodec::thread_id(logline);
+	    m_repeats = 0;
+	}
+
+	uint64_t repeats() const
+	{
+	    return m_repeats;
+	}
+
+	/* True if the run has repeats and started window_us or more before now */
+	bool expired(uint64_t now, uint64_t window_us) const
+	{
+	    return m_repeats != 0 && now - m_first_timestamp >= window_us;
+	}
+
+	/* Fills summary with the call site of the run and the count, at the time of the last repeat */
+	void summarize(NanoLogLine & summary) const
+	{
+	    RecordCodec::set_header(summary, m_last_timestamp, m_thread_id, m_record.data());
+	    summary << "last message repeated " << m_repeats << " times over " << (m_last_timestamp - m_first_timestamp) << " us";
+	}
+
+	void reset()
+	{
+	    m_record.clear();
+	    m_repeats = 0;
+	}
+
+    private:
+	std::vector < char > m_record;
+	uint64_t m_first_timestamp = 0;
+	uint64_t m_last_timestamp = 0;
+	uint32_t m_thread_id = 0;
+	uint64_t m_repeats = 0;
+    };
+
+    /*
+     * The buffer producers push to. A producer which loaded the pointer just before a
+     * re-initialization can still use it, see NanoLogger::reclaim_retired().
+     */
+    std::atomic < BufferBase * > atomic_buffer;
+
+    /*
+     * Moves the generation in the level word on. It wraps after 65536 buffers, a thread which
+     * slept through exactly that many keeps pushing to the buffer its BufferHazard holds on to,
+     * which is still drained. Generation 0 is skipped, it is what a thread which never logged has.
+     */
+    void publish_buffer(BufferBase * buffer)
+    {
+	atomic_buffer.store(buffer, std::memory_order_seq_cst);
+	unsigned int const previous = loglevel.fetch_add(1u << generation_shift, std::memory_order_release);
+	if ((previous >> generation_shift) + 1 == 1u << (32 - generation_shift))
+	    loglevel.fetch_add(1u << generation_shift, std::memory_order_release);
+    }
+
+    /*
+     * The buffer a producer thread has cached, published when the thread refreshes its cache
+     * and cleared when it exits. Nothing is published per line.
+     */
+    struct BufferHazard;
+    std::mutex buffer_hazards_mutex;
+    std::vector < BufferHazard * > buffer_hazards;
+
+    struct BufferHazard
+    {
+	BufferHazard()
+	{
+	    std::lock_guard < std::mutex > guard(buffer_hazards_mutex);
+	    buffer_hazards.push_back(this);
+	}
+
+	~BufferHazard()
+	{
+	    std::lock_guard < std::mutex > guard(buffer_hazards_mutex);
+	    buffer_hazards.erase(std::remove(buffer_hazards.begin(), buffer_hazards.end(), this), buffer_hazards.end());
+	}
+
+	/* Publishes the current buffer and returns it, once it is sure to be seen by is_cached() */
+	BufferBase * acquire()
+	{
+	    BufferBase * published = atomic_buffer.load(std::memory_order_seq_cst);
+	    BufferBase * cached;
+	    do
+	    {
+		cached = published;
+		buffer.store(cached, std::memory_order_seq_cst);
+		published = atomic_buffer.load(std::memory_order_seq_cst);
+	    } while (published != cached);
+	    return cached;
+	}
+
+	/* Whether some producer thread may still push to buffer, which is no longer published */
+	static bool is_cached(BufferBase const * buffer)
+	{
+	    std::lock_guard < std::mutex > guard(buffer_hazards_mutex);
+	    return std::any_of(buffer_hazards.begin(), buffer_hazards.end(), [buffer](BufferHazard const * hazard)
+		{ return hazard->buffer.load(std::memory_order_seq_cst) == buffer; });
+	}
+
+	std::atomic < BufferBase * > buffer = { nullptr };
+    };
+
+    class NanoLogger
+    {
+    public:
+	NanoLogger(BufferSettings const & buffer, std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb, ConsumerThread const & consumer_thread, FileRolling const & file_rolling)
+	    : m_state(State::INIT)
+	    , m_file_writer(log_directory, log_file_name, std::max(1u, log_file_roll_size_mb), file_rolling, buffer.flush_each_line)
+	    , m_lines_per_checkpoint(buffer.lines_per_checkpoint)
+	{
+	    start(consumer_thread, buffer.make);
+	}
+
+	~NanoLogger()
+	{
+	    m_state.store(State::SHUTDOWN);
+	    m_thread.join();
+	}
+
+	/*
+	 * Swaps in a new buffer and applies the new settings on the background thread.
+	 * Producers never wait. The previous buffer is retired, the background thread
+	 * keeps draining it for a while so lines from producers which raced with the
+	 * swap are still written.
+	 */
+	void reinitialize(BufferSettings const & buffer, std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb, ConsumerThread const & consumer_thread, FileRolling const & file_rolling)
+	{
+	    std::shared_ptr < BufferBase > prepared;
+	    if (consumer_thread.buffer_placement == BufferPlacement::PRODUCER)
+		prepared.reset(buffer.make());
+
+	    run_on_consumer([&]()
+	    {
+		configure(consumer_thread);
+		std::unique_ptr < BufferBase > fresh(prepared ? nullptr : buffer.make());
+		m_file_writer.reconfigure(log_directory, log_file_name, std::max(1u, log_file_roll_size_mb), file_rolling);
+		m_file_writer.set_flush_each_line(buffer.flush_each_line);
+		m_lines_per_checkpoint = buffer.lines_per_checkpoint;
+		m_retired.push_back(RetiredBuffer{ std::move(m_buffer_base), std::chrono::steady_clock::now() });
+		m_buffer_base.reset(fresh ? fresh.release() : new SharedBuffer(prepared));
+		publish_buffer(m_buffer_base.get());
+	    });
+	}
+
+	/* Changes where and how big log files are, starting with the next line written */
+	void reconfigure(std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb, FileRolling const & file_rolling)
+	{
+	    run_on_consumer([&]()
+	    {
+		m_file_writer.reconfigure(log_directory, log_file_name, std::max(1u, log_file_roll_size_mb), file_rolling);
+	    });
+	}
+	
+	void pop()
+	{
+	    // Wait for constructor to complete and pull all stores done there to this thread / core.
+	    while (m_state.load(std::memory_order_acquire) == State::INIT)
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+	    
+	    NanoLogLine logline(LogLevel::INFO, nullptr, nullptr, 0);
+	    uint32_t unflushed = 0;
+
+	    while (m_state.load() == State::READY)
+	    {
+		if (try_pop(logline))
+		{
+		    write(logline);
+		    if ((++m_popped & 1023) == 0)
+			govern();
+		    if (++unflushed == m_lines_per_checkpoint)
+		    {
+			flush();
+			unflushed = 0;
+		    }
+		    if (m_flush_pending.load(std::memory_order_acquire))
+			complete_flush_requests(false);
+		    if (m_tasks_pending.load(std::memory_order_acquire))
+			run_tasks();
+		}
+		else
+		{
+		    // Caught up, make everything written so far visible in the file.
+		    if (m_duplicates.expired(timestamp_now(), coalesce_window_ms.load(std::memory_order_relaxed) * 1000ull))
+		    {
+			end_run();
+			++unflushed;
+		    }
+		    govern();
+		    if (!m_retired.empty())
+			reclaim_retired();
+		    thread_names.purge(timestamp_now() - 1000000);
+		    if (unflushed != 0)
+		    {
+			flush();
+			unflushed = 0;
+		    }
+		    if (m_flush_pending.load(std::memory_order_acquire))
+			complete_flush_requests(false);
+		    if (m_tasks_pending.load(std::memory_order_acquire))
+			run_tasks();
+		    m_buffer_base->reserve();
+		    std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	    }
+	    
+	    // Pop and log all remaining entries
+	    for (RetiredBuffer & retired : m_retired)
+		retired.last_pop = std::chrono::steady_clock::time_point::max();
+	    while (try_pop(logline))
+	    {
+		write(logline);
+	    }
+	    end_run();
+	    if (m_governed != 0)
+		update_loglevel(governor_level_shift, 0);
+	    flush();
+	    complete_flush_requests(true);
+	    m_drained.store(true, std::memory_order_release);
+	}
+
+	/* Completes once every line claimed before the call is written and fsync'ed */
+	std::future < void > flush_async()
+	{
+	    std::promise < void > promise;
+	    std::future < void > future = promise.get_future();
+	    // Loaded under the lock, so the buffer cannot be reclaimed before the request is queued.
+	    std::lock_guard < std::mutex > guard(m_flush_mutex);
+	    BufferBase * buffer = atomic_buffer.load(std::memory_order_acquire);
+	    uint32_t const target = buffer->claimed();
+	    m_flush_requests.push_back(FlushRequest{ buffer, target, std::move(promise) });
+	    m_flush_pending.store(true, std::memory_order_release);
+	    return future;
+	}
+
+	/* Async signal safe. Asks the background thread to drain and waits a bounded time for it. */
+	void emergency_drain()
+	{
+	    m_state.store(State::SHUTDOWN);
+	    timespec const one_millisecond = { 0, 1000000 };
+	    for (int i = 0; i < 2000 && !m_drained.load(std::memory_order_acquire); ++i)
+		nanosleep(&one_millisecond, nullptr);
+	}
+	
+    private:
+	enum class State
+	{
+		INIT,
+		READY,
+		SHUTDOWN
+	};
+
+	/* Lets a buffer prepared by the caller of initialize() also be owned by the background thread */
+	class SharedBuffer : public BufferBase
+	{
+	public:
+	    SharedBuffer(std::shared_ptr < BufferBase > buffer) : m_buffer(std::move(buffer)) {}
+	    BufferBase * target() override { return m_buffer->target(); }
+	    void push(NanoLogLine && logline) override { m_buffer->push(std::move(logline)); }
+	    bool try_pop(NanoLogLine & logline) override { return m_buffer->try_pop(logline); }
+	    void on_flush() override { m_buffer->on_flush(); }
+	    void reserve() override { m_buffer->reserve(); }
+	    uint32_t capacity() const override { return m_buffer->capacity(); }
+	    uint32_t claimed() override { return m_buffer->claimed(); }
+	    uint32_t consumed() const override { return m_buffer->consumed(); }
+
+	private:
+	    std::shared_ptr < BufferBase > m_buffer;
+	};
+
+	/* A buffer replaced by re-initialization, drained until it has been idle for a grace period, then freed */
+	struct RetiredBuffer
+	{
+	    std::unique_ptr < BufferBase > buffer;
+	    std::chrono::steady_clock::time_point last_pop;	// min() once idle
+	};
+
+	struct FlushRequest
+	{
+	    BufferBase * buffer;
+	    uint32_t target;
+	    std::promise < void > done;
+	};
+
+	/*
+	 * Starts the background thread and creates the buffer on the thread which will
+	 * first touch its memory, which decides the NUMA node it lives on.
+	 */
+	void start(ConsumerThread const & consumer_thread, std::function < BufferBase * () > make_buffer)
+	{
+	    if (consumer_thread.buffer_placement == BufferPlacement::PRODUCER)
+		m_buffer_base.reset(make_buffer());
+
+	    std::shared_ptr < std::promise < void > > started(new std::promise < void >());
+	    m_thread = std::thread([this, consumer_thread, make_buffer, started]()
+	    {
+		try
+		{
+		    configure(consumer_thread);
+		    if (!m_buffer_base)
+			m_buffer_base.reset(make_buffer());
+		}
+		catch (...)
+		{
+		    started->set_exception(std::current_exception());
+		    return;
+		}
+		started->set_value();
+		pop();
+	    });
+
+	    try
+	    {
+		started->get_future().get();
+	    }
+	    catch (...)
+	    {
+		m_thread.join();
+		throw;
+	    }
+	    publish_buffer(m_buffer_base.get());
+	    m_state.store(State::READY, std::memory_order_release);
+	}
+
+	/* Applies name, scheduling and cpu affinity to the calling thread */
+	static void configure(ConsumerThread const & consumer_thread)
 	{
-	    roll_file();
+	    if (!consumer_thread.name.empty())
+		pthread_setname_np(pthread_self(), consumer_thread.name.substr(0, 15).c_str());
+
+	    if (!consumer_thread.cpus.empty())
+	    {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (int cpu : consumer_thread.cpus)
+		    CPU_SET(cpu, &cpus);
+		if (int const error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+		    throw std::system_error(error, std::generic_category(), "Cannot set cpu affinity of background thread");
+	    }
+
+	    if (consumer_thread.sched_policy != -1)
+	    {
+		sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = consumer_thread.sched_priority;
+		if (int const error = pthread_setschedparam(pthread_self(), consumer_thread.sched_policy, &param))
+		    throw std::system_error(error, std::generic_category(), "Cannot set scheduling policy of background thread");
+	    }
+
+	    // On Linux the nice value is per thread.
+	    if (consumer_thread.nice != 0 && setpriority(PRIO_PROCESS, static_cast < id_t >(syscall(SYS_gettid)), consumer_thread.nice) != 0)
+		throw std::system_error(errno, std::generic_category(), "Cannot set nice value of background thread");
 	}
-	
+
+	/* Writes logline unless duplicates are coalesced and it repeats the previous record */
 	void write(NanoLogLine & logline)
 	{
-	    auto pos = m_os->tellp();
-	    logline.stringify(*m_os);
-	    m_bytes_written += m_os->tellp() - pos;
-	    if (m_bytes_written > m_log_file_roll_size_bytes)
+	    uint32_t const window_ms = coalesce_window_ms.load(std::memory_order_relaxed);
+	    if (window_ms != 0 && m_duplicates.absorb(logline, window_ms * 1000ull))
 	    {
-		roll_file();
+		increment(metrics.lines_coalesced);
+		return;
 	    }
+	    end_run();
+	    m_file_writer.write(logline);
+	    if (window_ms != 0)
+		m_duplicates.start(logline);
 	}
 
-    private:
-	void roll_file()
+	/*
+	 * Raises the effective level while the backlog of the current buffer is above the
+	 * governor's threshold, restores it once below the lower one. See govern_verbosity().
+	 */
+	void govern()
 	{
-	    if (m_os)
+	    unsigned int const level = governor_level.load(std::memory_order_relaxed);
+	    uint32_t const capacity = m_buffer_base->capacity();
+	    if ((level == 0 && m_governed == 0) || capacity == 0)
+		return;
+	    uint32_t const backlog = m_buffer_base->claimed() - m_buffer_base->consumed();
+	    uint64_t const percent = static_cast < uint64_t >(backlog) * 100 / capacity;
+	    if (m_governed == 0 && percent >= governor_raise_percent.load(std::memory_order_relaxed))
 	    {
-		m_os->flush();
-		m_os->close();
+		m_governed = level;
+		update_loglevel(governor_level_shift, level);
+		NanoLogLine line(LogLevel::WARN, __FILE__, __func__, __LINE__);
+		line << "Background thread is " << backlog << " lines behind (" << static_cast < uint32_t >(percent) << "% of the queue), dropping lines below " << to_string(static_cast < LogLevel >(level)) << " at the source";
+		write(line);
+	    }
+	    else if (m_governed != 0 && (level == 0 || percent <= governor_restore_percent.load(std::memory_order_relaxed)))
+	    {
+		m_governed = 0;
+		update_loglevel(governor_level_shift, 0);
+		NanoLogLine line(LogLevel::WARN, __FILE__, __func__, __LINE__);
+		line << "Background thread caught up (" << backlog << " lines behind), back to the level set by set_log_level()";
+		write(line);
 	    }
-
-	    m_bytes_written = 0;
-	    m_os.reset(new std::ofstream());
-	    // TODO Optimize this part. Does it even matter ?
-	    std::string log_file_name = m_name;
-	    log_file_name.append(".");
-	    log_file_name.append(std::to_string(++m_file_number));
-	    log_file_name.append(".txt");
-	    m_os->open(log_file_name, std::ofstream::out | std::ofstream::trunc);
 	}
 
-    private:
-	uint32_t m_file_number = 0;
-	std::streamoff m_bytes_written = 0;
-	uint32_t const m_log_file_roll_size_bytes;
-	std::string const m_name;
-	std::unique_ptr < std::ofstream > m_os;
-    };
-
-    class NanoLogger
-    {
-    public:
-	NanoLogger(NonGuaranteedLogger ngl, std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb)
-	    : m_state(State::INIT)
-	    , m_buffer_base(new RingBuffer(std::max(1u, ngl.ring_buffer_size_mb) * 1024 * 4))
-	    , m_file_writer(log_directory, log_file_name, std::max(1u, log_file_roll_size_mb))
-	    , m_thread(&NanoLogger::pop, this)
+	/* Writes the summary of the current run of duplicates, if it has repeats */
+	void end_run()
 	{
-	    m_state.store(State::READY, std::memory_order_release);
+	    if (m_duplicates.repeats() != 0)
+	    {
+		NanoLogLine summary(LogLevel::INFO, nullptr, nullptr, 0);
+		m_duplicates.summarize(summary);
+		m_file_writer.write(summary);
+	    }
+	    m_duplicates.reset();
 	}
 
-	NanoLogger(GuaranteedLogger gl, std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb)
-	    : m_state(State::INIT)
-	    , m_buffer_base(new QueueBuffer())
-	    , m_file_writer(log_directory, log_file_name, std::max(1u, log_file_roll_size_mb))
-	    , m_thread(&NanoLogger::pop, this)
+	/* Retired buffers first, so lines logged before a re-initialization come out first */
+	bool try_pop(NanoLogLine & logline)
 	{
-	    m_state.store(State::READY, std::memory_order_release);
+	    if (!m_retired.empty())
+	    {
+		auto const now = std::chrono::steady_clock::now();
+		for (RetiredBuffer & retired : m_retired)
+		{
+		    if (retired.last_pop == std::chrono::steady_clock::time_point::min())
+			continue;
+		    if (retired.buffer->try_pop(logline))
+		    {
+			retired.last_pop = std::max(retired.last_pop, now);
+			return true;
+		    }
+		    if (now - retired.last_pop > std::chrono::seconds(1))
+			retired.last_pop = std::chrono::steady_clock::time_point::min();    // Idle, stop polling it
+		}
+	    }
+	    return m_buffer_base->try_pop(logline);
 	}
 
-	~NanoLogger()
+	void flush()
 	{
-	    m_state.store(State::SHUTDOWN);
-	    m_thread.join();
+	    m_file_writer.flush();
+	    for (RetiredBuffer & retired : m_retired)
+		retired.buffer->on_flush();
+	    m_buffer_base->on_flush();
 	}
 
-	void add(NanoLogLine && logline)
+	/*
+	 * Frees idle retired buffers which no producer thread has cached any more, see BufferHazard.
+	 * A thread which cached one and has not logged since keeps it, and its lines are still
+	 * picked up here. Lines left in a buffer are written before it is freed.
+	 */
+	void reclaim_retired()
 	{
-	    m_buffer_base->push(std::move(logline));
+	    bool written = false;
+	    std::lock_guard < std::mutex > guard(m_flush_mutex);
+	    for (auto it = m_retired.begin(); it != m_retired.end(); )
+	    {
+		if (it->last_pop != std::chrono::steady_clock::time_point::min())
+		{
+		    ++it;
+		    continue;
+		}
+		BufferBase * const buffer = it->buffer.get();
+		bool const cached = BufferHazard::is_cached(buffer);
+		bool const awaited = std::any_of(m_flush_requests.begin(), m_flush_requests.end(), [buffer](FlushRequest const & request) { return request.buffer == buffer; });
+		NanoLogLine logline(LogLevel::INFO, nullptr, nullptr, 0);
+		while (buffer->try_pop(logline))
+		{
+		    write(logline);
+		    written = true;
+		}
+		if (!cached && !awaited)
+		{
+		    // The lines reach the file before a journal goes away with the buffer.
+		    if (written)
+			flush();
+		    it = m_retired.erase(it);
+		}
+		else
+		{
+		    ++it;
+		}
+	    }
 	}
-	
-	void pop()
+
+	/* Syncs the file if the consumer has reached any flush barrier and completes those */
+	void complete_flush_requests(bool shutdown)
 	{
-	    // Wait for constructor to complete and pull all stores done there to this thread / core.
-	    while (m_state.load(std::memory_order_acquire) == State::INIT)
-		std::this_thread::sleep_for(std::chrono::microseconds(50));
-	    
-	    NanoLogLine logline(LogLevel::INFO, nullptr, nullptr, 0);
+	    auto not_reached = [shutdown](FlushRequest const & request)
+	    {
+		return !shutdown && static_cast < int32_t >(request.buffer->consumed() - request.target) < 0;
+	    };
+	    std::lock_guard < std::mutex > guard(m_flush_mutex);
+	    auto reached = std::partition(m_flush_requests.begin(), m_flush_requests.end(), not_reached);
+	    if (reached == m_flush_requests.end())
+		return;
+	    end_run();
+	    m_file_writer.sync();
+	    flush();
+	    for (auto it = reached; it != m_flush_requests.end(); ++it)
+		it->done.set_value();
+	    m_flush_requests.erase(reached, m_flush_requests.end());
+	    m_flush_pending.store(!m_flush_requests.empty(), std::memory_order_relaxed);
+	}
 
-	    while (m_state.load() == State::READY)
+	/* Runs task on the background thread and waits for it, rethrowing what it throws */
+	void run_on_consumer(std::function < void () > task)
+	{
+	    std::packaged_task < void () > packaged(std::move(task));
+	    std::future < void > done = packaged.get_future();
 	    {
-		if (m_buffer_base->try_pop(logline))
-		    m_file_writer.write(logline);
-		else
-		    std::this_thread::sleep_for(std::chrono::microseconds(50));
+		std::lock_guard < std::mutex > guard(m_task_mutex);
+		m_tasks.push_back(std::move(packaged));
+		m_tasks_pending.store(true, std::memory_order_release);
 	    }
-	    
-	    // Pop and log all remaining entries
-	    while (m_buffer_base->try_pop(logline))
+	    done.get();
+	}
+
+	void run_tasks()
+	{
+	    std::vector < std::packaged_task < void () > > tasks;
 	    {
-		m_file_writer.write(logline);
+		std::lock_guard < std::mutex > guard(m_task_mutex);
+		tasks.swap(m_tasks);
+		m_tasks_pending.store(false, std::memory_order_relaxed);
 	    }
+	    for (auto & task : tasks)
+		task();
 	}
-	
-    private:
-	enum class State
-	{
-		INIT,
-		READY,
-		SHUTDOWN
-	};
 
 	std::atomic < State > m_state;
+	std::atomic < bool > m_drained = { false };
 	std::unique_ptr < BufferBase > m_buffer_base;
+	std::vector < RetiredBuffer > m_retired;
 	FileWriter m_file_writer;
+	DuplicateFilter m_duplicates;
+	unsigned int m_governed = 0;	// Level imposed by govern(), 0 if none
+	uint32_t m_popped = 0;
+	uint32_t m_lines_per_checkpoint;
+	std::mutex m_flush_mutex;
+	std::vector < FlushRequest > m_flush_requests;
+	std::atomic < bool > m_flush_pending = { false };
+	std::mutex m_task_mutex;
+	std::vector < std::packaged_task < void () > > m_tasks;
+	std::atomic < bool > m_tasks_pending = { false };
 	std::thread m_thread;
     };
 
+    std::mutex initialize_mutex;
     std::unique_ptr < NanoLogger > nanologger;
     std::atomic < NanoLogger * > atomic_nanologger;
+    // SharedMemoryLogger queues, the current one and those replaced by initialize(), kept until exit
+    std::vector < std::unique_ptr < RingBuffer > > shared_queues;
+    std::atomic < RingBuffer * > atomic_shared_queue;
+
+    /*
+     * What a producer thread pushes to, refreshed when the generation in the level word changes.
+     * Zero initialized, so using it costs no thread_local guard.
+     */
+    struct ProducerHandle
+    {
+	BufferBase * buffer;
+	ProducerCounters * counters;
+	unsigned int generation;
+	BufferKind kind;
+
+	void refresh(unsigned int current)
+	{
+	    static thread_local BufferHazard hazard;
+	    // Pairs with publish_buffer(), current was loaded relaxed.
+	    std::atomic_thread_fence(std::memory_order_acquire);
+	    buffer = hazard.acquire()->target();
+	    kind = buffer->kind();
+	    counters = &producer_counters();
+	    generation = current;
+	}
+    };
 
     bool NanoLog::operator==(NanoLogLine & logline)
     {
-	atomic_nanologger.load(std::memory_order_acquire)->add(std::move(logline));
+	static thread_local ProducerHandle handle;
+	// The level word, just loaded by is_logged(), so no other global is touched per line.
+	unsigned int const generation = loglevel.load(std::memory_order_relaxed) >> generation_shift;
+	if (handle.generation != generation)
+	    handle.refresh(generation);
+	// The buffer classes are final, so these calls are not virtual.
+	switch (handle.kind)
+	{
+	case BufferKind::RING:
+	    static_cast < RingBuffer * >(handle.buffer)->push(std::move(logline));
+	    break;
+	case BufferKind::QUEUE:
+	    static_cast < QueueBuffer * >(handle.buffer)->push(std::move(logline));
+	    break;
+	case BufferKind::OTHER:
+	    handle.buffer->push(std::move(logline));
+	    break;
+	}
+	increment(handle.counters->enqueued);
 	return true;
     }
 
-    void initialize(NonGuaranteedLogger ngl, std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb)
+    template < typename Logger >
+    void initialize(Logger logger, std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb, ConsumerThread const & consumer_thread, FileRolling const & file_rolling)
     {
-	nanologger.reset(new NanoLogger(ngl, log_directory, log_file_name, log_file_roll_size_mb));
+	std::lock_guard < std::mutex > guard(initialize_mutex);
+	if (nanologger)
+	    nanologger->reinitialize(buffer_settings(logger, consumer_thread), log_directory, log_file_name, log_file_roll_size_mb, consumer_thread, file_rolling);
+	else
+	    nanologger.reset(new NanoLogger(buffer_settings(logger, consumer_thread), log_directory, log_file_name, log_file_roll_size_mb, consumer_thread, file_rolling));
+	atomic_shared_queue.store(nullptr, std::memory_order_seq_cst);
+	intern_enabled.store(true, std::memory_order_relaxed);
 	atomic_nanologger.store(nanologger.get(), std::memory_order_seq_cst);
     }
 
-    void initialize(GuaranteedLogger gl, std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb)
+    void initialize(NonGuaranteedLogger ngl, std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb, ConsumerThread const & consumer_thread, FileRolling const & file_rolling)
     {
-	nanologger.reset(new NanoLogger(gl, log_directory, log_file_name, log_file_roll_size_mb));
-	atomic_nanologger.store(nanologger.get(), std::memory_order_seq_cst);
+	initialize < NonGuaranteedLogger >(ngl, log_directory, log_file_name, log_file_roll_size_mb, consumer_thread, file_rolling);
     }
 
-    std::atomic < unsigned int > loglevel = {0};
+    void initialize(GuaranteedLogger gl, std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb, ConsumerThread const & consumer_thread, FileRolling const & file_rolling)
+    {
+	initialize < GuaranteedLogger >(gl, log_directory, log_file_name, log_file_roll_size_mb, consumer_thread, file_rolling);
+    }
+
+    void initialize(SharedMemoryCollector smc, std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb, ConsumerThread const & consumer_thread, FileRolling const & file_rolling)
+    {
+	initialize < SharedMemoryCollector >(smc, log_directory, log_file_name, log_file_roll_size_mb, consumer_thread, file_rolling);
+    }
+
+    /* A background thread started by an earlier initialize() keeps draining what was queued before */
+    void initialize(SharedMemoryLogger sml)
+    {
+	std::lock_guard < std::mutex > guard(initialize_mutex);
+	std::string const path = sml.queue_directory + "/" + program_invocation_short_name + "." + std::to_string(::getpid()) + ".queue";
+	std::unique_ptr < RingBuffer > queue(new RingBuffer(std::max(1u, sml.ring_buffer_size_mb) * 1024 * 1024 / slot_size, path, false));
+	intern_enabled.store(false, std::memory_order_relaxed);
+	atomic_nanologger.store(nullptr, std::memory_order_seq_cst);
+	atomic_shared_queue.store(queue.get(), std::memory_order_seq_cst);
+	publish_buffer(queue.get());
+	shared_queues.push_back(std::move(queue));
+    }
+
+    /*
+     * Completes the flush requests of a SharedMemoryLogger once the collector has written the
+     * lines of their queue up to target. One thread polls for all of them. It is started with
+     * the first request and joined at exit before shared_queues goes away, requests still
+     * waiting then are abandoned and their futures report std::broken_promise.
+     */
+    class CollectorWaiter
+    {
+    public:
+	~CollectorWaiter()
+	{
+	    {
+		std::lock_guard < std::mutex > guard(m_mutex);
+		m_stop = true;
+	    }
+	    m_wake.notify_one();
+	    if (m_thread.joinable())
+		m_thread.join();
+	}
+
+	/* id, if given, is what to cancel() the request by */
+	std::future < void > wait(RingBuffer * queue, uint32_t target, uint64_t * id = nullptr)
+	{
+	    std::promise < void > done;
+	    std::future < void > future = done.get_future();
+	    {
+		std::lock_guard < std::mutex > guard(m_mutex);
+		if (!m_thread.joinable())
+		    m_thread = std::thread(&CollectorWaiter::run, this);
+		m_requests.push_back(Request{ ++m_last_id, queue, target, std::move(done) });
+		if (id)
+		    *id = m_last_id;
+	    }
+	    m_wake.notify_one();
+	    return future;
+	}
+
+	/* Forgets a request the caller stopped waiting for */
+	void cancel(uint64_t id)
+	{
+	    std::lock_guard < std::mutex > guard(m_mutex);
+	    m_requests.erase(std::remove_if(m_requests.begin(), m_requests.end(), [id](Request const & request) { return request.id == id; }), m_requests.end());
+	}
+
+    private:
+	struct Request
+	{
+	    uint64_t id;
+	    RingBuffer * queue;
+	    uint32_t target;
+	    std::promise < void > done;
+	};
+
+	void run()
+	{
+	    auto not_collected = [](Request const & request) { return static_cast < int32_t >(request.queue->collected() - request.target) < 0; };
+	    std::unique_lock < std::mutex > lock(m_mutex);
+	    while (!m_stop)
+	    {
+		auto reached = std::partition(m_requests.begin(), m_requests.end(), not_collected);
+		for (auto it = reached; it != m_requests.end(); ++it)
+		    it->done.set_value();
+		m_requests.erase(reached, m_requests.end());
+		if (m_requests.empty())
+		    m_wake.wait(lock, [this]() { return m_stop || !m_requests.empty(); });
+		else
+		    m_wake.wait_for(lock, std::chrono::microseconds(100));
+	    }
+	}
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::vector < Request > m_requests;
+	uint64_t m_last_id = 0;
+	bool m_stop = false;
+	std::thread m_thread;
+    };
+
+    // Declared after shared_queues, so it is destroyed first.
+    CollectorWaiter collector_waiter;
+
+    void reconfigure(std::string const & log_directory, std::string const & log_file_name, uint32_t log_file_roll_size_mb, FileRolling const & file_rolling)
+    {
+	std::lock_guard < std::mutex > guard(initialize_mutex);
+	if (nanologger)
+	    nanologger->reconfigure(log_directory, log_file_name, log_file_roll_size_mb, file_rolling);
+    }
+
+    std::future < void > flush_async()
+    {
+	if (RingBuffer * queue = atomic_shared_queue.load(std::memory_order_acquire))
+	    return collector_waiter.wait(queue, queue->claimed());
+	if (NanoLogger * logger = atomic_nanologger.load(std::memory_order_acquire))
+	    return logger->flush_async();
+	std::promise < void > nothing_logged;
+	nothing_logged.set_value();
+	return nothing_logged.get_future();
+    }
+
+    void flush()
+    {
+	flush_async().wait();
+    }
+
+    bool flush(uint32_t timeout_ms)
+    {
+	if (RingBuffer * queue = atomic_shared_queue.load(std::memory_order_acquire))
+	{
+	    uint64_t id = 0;
+	    std::future < void > collected = collector_waiter.wait(queue, queue->claimed(), &id);
+	    if (collected.wait_for(std::chrono::milliseconds(timeout_ms)) == std::future_status::ready)
+		return true;
+	    collector_waiter.cancel(id);
+	    return false;
+	}
+	return flush_async().wait_for(std::chrono::milliseconds(timeout_ms)) == std::future_status::ready;
+    }
+
+    void crash_handler(int signal_number)
+    {
+	if (NanoLogger * logger = atomic_nanologger.load(std::memory_order_acquire))
+	    logger->emergency_drain();
+	std::signal(signal_number, SIG_DFL);
+	std::raise(signal_number);
+    }
+
+    void install_crash_handler()
+    {
+	for (int signal_number : { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT })
+	    std::signal(signal_number, &crash_handler);
+    }
+
+    size_t recover_crash_journal(std::string const & crash_journal, std::ostream & os)
+    {
+	std::ifstream file(crash_journal, std::ifstream::binary);
+	std::vector < char > journal((std::istreambuf_iterator < char >(file)), std::istreambuf_iterator < char >());
+	JournalHeader const & header = *reinterpret_cast < JournalHeader const * >(journal.data());
+	if (journal.size() < JournalHeader::items_offset || memcmp(header.magic, journal_magic, sizeof(journal_magic)) != 0)
+	    throw std::runtime_error(crash_journal + " is not a NanoLog crash journal");
+	if (header.version != JournalHeader::current_version || header.item_size != sizeof(RingBuffer::Item) 
+	    || journal.size() < JournalHeader::items_offset + header.slots * header.item_size)
+	    throw std::runtime_error(crash_journal + " was written by an incompatible NanoLog build");
+
+	LiteralTable literals;
+	LiteralResolver resolver(header, literals);
+	RingBuffer::Item const * items = reinterpret_cast < RingBuffer::Item const * >(journal.data() + JournalHeader::items_offset);
+	std::vector < RingBuffer::Item const * > written;
+	for (size_t i = 0; i < header.slots; ++i)
+	{
+	    if (items[i].written != 0)
+		written.push_back(items + i);
+	}
+	// Push order, the sequence wraps at 2^32 but a ring never spans more than 2^31 of it.
+	std::sort(written.begin(), written.end(), [](RingBuffer::Item const * a, RingBuffer::Item const * b)
+	    { return static_cast < int32_t >(a->sequence - b->sequence) < 0; });
+
+	std::vector < NanoLogLine > lines;
+	for (RingBuffer::Item const * item : written)
+	{
+	    lines.emplace_back(LogLevel::INFO, nullptr, nullptr, 0);
+	    bool const complete = RecordCodec::restore(lines.back(), item->logline);
+	    RecordCodec::for_each_literal(lines.back(), [&resolver](char const * & literal) { literal = resolver.resolve(literal); });
+	    RecordCodec::forget_interned(lines.back());
+	    if (!complete)
+		lines.back() << "<arguments were on the heap and are lost>";
+	}
+
+	for (NanoLogLine & line : lines)
+	    line.stringify(os);
+	return lines.size();
+    }
+
+    /*
+     * What query_log_files() needs of a line, parsed from any of the output formats.
+     * Returns false for lines which are not the start of a record, e.g. the rest of a
+     * TEXT record with a new line in it.
+     */
+    struct ParsedLine
+    {
+	uint64_t timestamp;
+	LogLevel level;
+	std::string file;
+	uint32_t line;
+    };
+
+    /* 2016-10-13 00:01:23.528514 or 2016-10-13T00:01:23.528514Z */
+    bool parse_timestamp(char const * s, uint64_t & timestamp)
+    {
+	tm t = {};
+	unsigned int microseconds = 0;
+	if (sscanf(s, "%4d-%2d-%2d%*1[ T]%2d:%2d:%2d.%6u", &t.tm_year, &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec, &microseconds) != 7)
+	    return false;
+	t.tm_year -= 1900;
+	t.tm_mon -= 1;
+	timestamp = static_cast < uint64_t >(timegm(&t)) * 1000000 + microseconds;
+	return true;
+    }
+
+    bool parse_level(char const * s, LogLevel & level)
+    {
+	for (LogLevel l : { LogLevel::INFO, LogLevel::WARN, LogLevel::CRIT })
+	{
+	    if (strncmp(s, to_string(l), 4) == 0)
+	    {
+		level = l;
+		return true;
+	    }
+	}
+	return false;
+    }
+
+    /* Value of a JSON / logfmt field, without quotes. Good enough for ts, level, file and line. */
+    bool find_field(std::string const & text, char const * key, bool json, std::string & value)
+    {
+	std::string const pattern = json ? std::string(",\"") + key + "\":" : std::string(" ") + key + "=";
+	size_t begin = text.find(pattern);
+	if (begin == std::string::npos)
+	{
+	    // The first field has no separator in front of it.
+	    std::string const first = json ? std::string("{\"") + key + "\":" : std::string(key) + "=";
+	    if (text.compare(0, first.size(), first) != 0)
+		return false;
+	    begin = first.size();
+	}
+	else
+	    begin += pattern.size();
+	bool const quoted = begin < text.size() && text[begin] == '"';
+	begin += quoted;
+	size_t const end = text.find_first_of(quoted ? "\"" : json ? ",}" : " ", begin);
+	value = text.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+	return true;
+    }
+
+    bool parse_line(std::string const & text, ParsedLine & parsed)
+    {
+	if (text.empty())
+	    return false;
+	if (text[0] == '[')
+	{
+	    // [2016-10-13 00:01:23.528514][INFO][thread][file:function:line] message
+	    if (text.size() < 34 || !parse_timestamp(text.c_str() + 1, parsed.timestamp) || !parse_level(text.c_str() + 29, parsed.level))
+		return false;
+	    size_t const source = text.find("][", 34);
+	    size_t const end = source == std::string::npos ? source : text.find("] ", source + 2);
+	    if (end == std::string::npos)
+		return false;
+	    std::string const location = text.substr(source + 2, end - source - 2);
+	    size_t const file_end = location.find(':');
+	    size_t const line_begin = location.rfind(':');
+	    parsed.file = location.substr(0, file_end);
+	    parsed.line = static_cast < uint32_t >(strtoul(location.c_str() + line_begin + 1, nullptr, 10));
+	    return true;
+	}
+	bool const json = text[0] == '{';
+	std::string ts, level, file, line;
+	if (!find_field(text, "ts", json, ts) || !parse_timestamp(ts.c_str(), parsed.timestamp)
+	    || !find_field(text, "level", json, level) || !parse_level(level.c_str(), parsed.level))
+	    return false;
+	find_field(text, "file", json, parsed.file);
+	parsed.line = find_field(text, "line", json, line) ? static_cast < uint32_t >(strtoul(line.c_str(), nullptr, 10)) : 0;
+	return true;
+    }
+
+    /* Filters and copies the complete lines of [offset, offset + bytes) of file to os */
+    class QueryScanner
+    {
+    public:
+	QueryScanner(LogQuery const & query, std::ostream & os) : m_query(query), m_os(os), m_matched(0)
+	{
+	    size_t const colon = query.source.rfind(':');
+	    bool const has_line = colon != std::string::npos && colon + 1 < query.source.size() && query.source.find_first_not_of("0123456789", colon + 1) == std::string::npos;
+	    m_source_file = has_line ? query.source.substr(0, colon) : query.source;
+	    m_source_line = has_line ? static_cast < uint32_t >(strtoul(query.source.c_str() + colon + 1, nullptr, 10)) : 0;
+	}
+
+	void scan(std::ifstream & file, uint64_t offset, uint64_t bytes)
+	{
+	    file.clear();
+	    file.seekg(offset);
+	    bool matching = false;
+	    std::string text;
+	    for (uint64_t read = 0; read < bytes && std::getline(file, text); read += text.size() + 1)
+	    {
+		ParsedLine parsed;
+		if (parse_line(text, parsed))
+		    matching = matches(parsed);
+		if (matching)
+		{
+		    m_os << text << '\n';
+		    ++m_matched;
+		}
+	    }
+	}
+
+	size_t matched() const
+	{
+	    return m_matched;
+	}
+
+    private:
+	bool matches(ParsedLine const & parsed) const
+	{
+	    if (parsed.timestamp < m_query.from_us || parsed.timestamp > m_query.to_us || parsed.level < m_query.min_level)
+		return false;
+	    if (m_source_line != 0 && parsed.line != m_source_line)
+		return false;
+	    return parsed.file.size() >= m_source_file.size() && parsed.file.compare(parsed.file.size() - m_source_file.size(), m_source_file.size(), m_source_file) == 0;
+	}
+
+	LogQuery const & m_query;
+	std::ostream & m_os;
+	size_t m_matched;
+	std::string m_source_file;
+	uint32_t m_source_line;
+    };
+
+    size_t query_log_files(std::vector < std::string > const & files, LogQuery const & query, std::ostream & os)
+    {
+	QueryScanner scanner(query, os);
+	for (std::string const & path : files)
+	{
+	    std::ifstream file(path, std::ifstream::binary);
+	    if (!file)
+		throw std::runtime_error("Cannot open " + path);
+	    file.seekg(0, std::ifstream::end);
+	    uint64_t const size = static_cast < uint64_t >(file.tellg());
+
+	    // Only read the blocks which can hold matching lines, then whatever is not indexed yet.
+	    uint64_t indexed = 0;
+	    std::ifstream index(index_path(path), std::ifstream::binary);
+	    IndexHeader header;
+	    if (index.read(reinterpret_cast < char * >(&header), sizeof(header)) && memcmp(header.magic, index_magic, sizeof(index_magic)) == 0 && header.version == 1)
+	    {
+		IndexEntry entry;
+		while (index.read(reinterpret_cast < char * >(&entry), sizeof(entry)) && entry.offset + entry.bytes <= size)
+		{
+		    uint32_t at_level = 0;
+		    for (size_t level = static_cast < size_t >(query.min_level); level < IndexEntry::levels; ++level)
+			at_level += entry.level_counts[level];
+		    if (at_level != 0 && entry.max_timestamp >= query.from_us && entry.min_timestamp <= query.to_us)
+			scanner.scan(file, entry.offset, entry.bytes);
+		    indexed = entry.offset + entry.bytes;
+		}
+	    }
+	    scanner.scan(file, indexed, size - indexed);
+	}
+	return scanner.matched();
+    }
+
+    void set_thread_name(std::string const & name)
+    {
+	static thread_local ThreadNameOwner owner;
+	owner.named = true;
+	thread_names.set(this_thread_id(), name);
+	pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+    }
 
     void set_log_level(LogLevel level)
     {
-	loglevel.store(static_cast<unsigned int>(level), std::memory_order_release);
+	update_loglevel(user_level_shift, static_cast<unsigned int>(level));
+    }
+
+    void set_output_format(OutputFormat format)
+    {
+	outputformat.store(static_cast < unsigned int >(format), std::memory_order_relaxed);
     }
 
-    bool is_logged(LogLevel level)
+    void coalesce_duplicates(uint32_t window_ms)
     {
-	return static_cast<unsigned int>(level) >= loglevel.load(std::memory_order_relaxed);
+	coalesce_window_ms.store(window_ms, std::memory_order_relaxed);
+    }
+
+    void govern_verbosity(LogLevel level, uint32_t raise_percent, uint32_t restore_percent)
+    {
+	governor_raise_percent.store(raise_percent, std::memory_order_relaxed);
+	governor_restore_percent.store(std::min(restore_percent, raise_percent), std::memory_order_relaxed);
+	governor_level.store(static_cast < unsigned int >(level), std::memory_order_relaxed);
+    }
+
+    Stats stats()
+    {
+	Stats s = {};
+	for (ProducerCounters const & counters : metrics.producer)
+	{
+	    s.lines_enqueued += counters.enqueued.load(std::memory_order_relaxed);
+	    s.lines_dropped += counters.dropped.load(std::memory_order_relaxed);
+	}
+	s.lines_written = metrics.lines_written.load(std::memory_order_relaxed);
+	s.buffer_count = metrics.buffer_count.load(std::memory_order_relaxed);
+	s.buffer_high_water_mark = metrics.buffer_high_water_mark.load(std::memory_order_relaxed);
+	s.consumer_lag_us = metrics.consumer_lag_us.load(std::memory_order_relaxed);
+	s.max_consumer_lag_us = metrics.max_consumer_lag_us.load(std::memory_order_relaxed);
+	s.bytes_written = metrics.bytes_written.load(std::memory_order_relaxed);
+	s.roll_count = metrics.roll_count.load(std::memory_order_relaxed);
+	s.lines_coalesced = metrics.lines_coalesced.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < Stats::write_latency_buckets; ++i)
+	    s.write_latency_ns[i] = metrics.write_latency_ns[i].load(std::memory_order_relaxed);
+	return s;
     }
 
 } // namespace nanologger
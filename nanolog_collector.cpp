@@ -0,0 +1,86 @@
+#include "NanoLog.hpp"
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+static bool parse_format(char const * s, nanolog::OutputFormat & format)
+{
+    if (strcmp(s, "text") == 0)
+	format = nanolog::OutputFormat::TEXT;
+    else if (strcmp(s, "json") == 0)
+	format = nanolog::OutputFormat::JSON;
+    else if (strcmp(s, "logfmt") == 0)
+	format = nanolog::OutputFormat::LOGFMT;
+    else
+	return false;
+    return true;
+}
+
+/*
+ * Writes the lines of every process on the box which logs with nanolog::SharedMemoryLogger
+ * to one set of log files, until SIGINT or SIGTERM. Lines still queued then are written
+ * before it exits.
+ */
+int main(int argc, char * argv[])
+{
+    nanolog::OutputFormat format = nanolog::OutputFormat::TEXT;
+    nanolog::FileRolling file_rolling;
+    std::vector < std::string > arguments;
+    bool valid = true;
+    for (int i = 1; i < argc && valid; ++i)
+    {
+	if (strncmp(argv[i], "--", 2) != 0)
+	{
+	    arguments.push_back(argv[i]);
+	    continue;
+	}
+	char const * option = argv[i];
+	char const * value = ++i < argc ? argv[i] : "";
+	if (strcmp(option, "--format") == 0)
+	    valid = parse_format(value, format);
+	else if (strcmp(option, "--max-files") == 0)
+	    file_rolling.max_files = static_cast < uint32_t >(strtoul(value, nullptr, 10));
+	else if (strcmp(option, "--index-kb") == 0)
+	    file_rolling.index_block_kb = static_cast < uint32_t >(strtoul(value, nullptr, 10));
+	else
+	    valid = false;
+    }
+
+    if (!valid || arguments.size() < 3 || arguments.size() > 4)
+    {
+	fprintf(stderr, "Usage: %s [--format text|json|logfmt] [--max-files <n>] [--index-kb <kb>] <queue directory> <log directory> <log file name> [roll size mb]\n", argv[0]);
+	fprintf(stderr, "For example: %s /dev/shm/nanolog /var/log/ nanolog 64\n", argv[0]);
+	return 1;
+    }
+
+    // Blocked before the background thread starts, so only sigwait() sees them.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    try
+    {
+	uint32_t const roll_size_mb = arguments.size() == 4 ? static_cast < uint32_t >(strtoul(arguments[3].c_str(), nullptr, 10)) : 64;
+	nanolog::ConsumerThread consumer_thread;
+	consumer_thread.name = "nanolog_collect";
+	nanolog::set_output_format(format);
+	nanolog::initialize(nanolog::SharedMemoryCollector(arguments[0]), arguments[1], arguments[2], roll_size_mb, consumer_thread, file_rolling);
+    }
+    catch (std::exception const & e)
+    {
+	fprintf(stderr, "%s\n", e.what());
+	return 1;
+    }
+
+    int signal_number = 0;
+    sigwait(&signals, &signal_number);
+    LOG_INFO << "Stopping on signal " << signal_number;
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "NanoLog.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/* Microseconds since epoch, or a UTC time as 2016-10-13 00:01:23[.528514] */
+static bool parse_time(char const * s, uint64_t & us)
+{
+    tm t = {};
+    unsigned int microseconds = 0;
+    int const fields = sscanf(s, "%4d-%2d-%2d%*1[ T]%2d:%2d:%2d.%6u", &t.tm_year, &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec, &microseconds);
+    if (fields >= 6)
+    {
+	t.tm_year -= 1900;
+	t.tm_mon -= 1;
+	us = static_cast < uint64_t >(timegm(&t)) * 1000000 + (fields == 7 ? microseconds : 0);
+	return true;
+    }
+    char * end = nullptr;
+    us = strtoull(s, &end, 10);
+    return *s != '\0' && *end == '\0';
+}
+
+static bool parse_level(char const * s, nanolog::LogLevel & level)
+{
+    if (strcmp(s, "INFO") == 0)
+	level = nanolog::LogLevel::INFO;
+    else if (strcmp(s, "WARN") == 0)
+	level = nanolog::LogLevel::WARN;
+    else if (strcmp(s, "CRIT") == 0)
+	level = nanolog::LogLevel::CRIT;
+    else
+	return false;
+    return true;
+}
+
+/*
+ * Prints the lines of NanoLog log files within a time range, at or above a level
+ * and / or from a source file and line. Uses the .idx files next to the logs to
+ * only read the blocks that can match.
+ */
+int main(int argc, char * argv[])
+{
+    nanolog::LogQuery query;
+    std::vector < std::string > files;
+    bool valid = true;
+    for (int i = 1; i < argc && valid; ++i)
+    {
+	if (strncmp(argv[i], "--", 2) != 0)
+	{
+	    files.push_back(argv[i]);
+	    continue;
+	}
+	char const * option = argv[i];
+	char const * value = ++i < argc ? argv[i] : "";
+	if (strcmp(option, "--from") == 0)
+	    valid = parse_time(value, query.from_us);
+	else if (strcmp(option, "--to") == 0)
+	    valid = parse_time(value, query.to_us);
+	else if (strcmp(option, "--level") == 0)
+	    valid = parse_level(value, query.min_level);
+	else if (strcmp(option, "--source") == 0)
+	    query.source = value;
+	else
+	    valid = false;
+    }
+
+    if (!valid || files.empty())
+    {
+	fprintf(stderr, "Usage: %s [--from <time>] [--to <time>] [--level INFO|WARN|CRIT] [--source file.cpp[:line]] <log file>...\n", argv[0]);
+	fprintf(stderr, "Times are microseconds since epoch or UTC, e.g. \"2016-10-13 00:01:23.528514\"\n");
+	return 1;
+    }
+
+    try
+    {
+	nanolog::query_log_files(files, query, std::cout);
+    }
+    catch (std::exception const & e)
+    {
+	fprintf(stderr, "%s\n", e.what());
+	return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+#include "NanoLog.hpp"
+#include <cstdio>
+#include <exception>
+#include <iostream>
+
+/*
+ * Prints the lines left in a NanoLog crash journal, oldest first.
+ * Run it on the same machine and binaries as the process that crashed,
+ * string literals are read back from those.
+ */
+int main(int argc, char * argv[])
+{
+    if (argc != 2)
+    {
+	fprintf(stderr, "Usage: %s <crash journal>\n", argv[0]);
+	return 1;
+    }
+
+    try
+    {
+	size_t const recovered = nanolog::recover_crash_journal(argv[1], std::cout);
+	fprintf(stderr, "Recovered %zu lines from %s\n", recovered, argv[1]);
+    }
+    catch (std::exception const & e)
+    {
+	fprintf(stderr, "%s\n", e.what());
+	return 1;
+    }
+
+    return 0;
+}